@@ -3,8 +3,15 @@ set -ev
 
 source ./config.sh
 
+# "./compile.sh -" encodes a stream of PNG frames from stdin instead
+if [[ "$1" == "-" ]]; then
+	input=(-f image2pipe -framerate $ANIMATION_FRAME_RATE -i -)
+else
+	input=(-r $ANIMATION_FRAME_RATE -i "%"${ANIMATION_BUILD_FRAMES_ZEROS}d.png)
+fi
+
 pushd ../flattened
-$FFMPEG -r $ANIMATION_FRAME_RATE -i "%"${ANIMATION_BUILD_FRAMES_ZEROS}d.png \
+$FFMPEG "${input[@]}" \
 	-tune film \
 	-movflags +faststart \
 	-vcodec libx264 \
@@ -12,6 +12,16 @@ MAGICK=$(which magick || echo )
 IM_CONVERT="$MAGICK convert"
 IM_COMPOSITE="$MAGICK composite"
 
+# cuts retrieved at once. downloads mostly wait on the link while
+# extraction is bound by the cores, so default to twice the cores
+RETRIEVE_JOBS="${RETRIEVE_JOBS:-$(( $(nproc) * 2 ))}"
+
+# slices of a seekable cut (see newarchive.sh) decompressed at once
+EXTRACT_JOBS="${EXTRACT_JOBS:-$(nproc)}"
+
+# content addressed store of verified sources, see retrieve.sh
+CITEST_CACHE="${CITEST_CACHE:-${XDG_CACHE_HOME:-$HOME/.cache}/citest}"
+
 animation_pre_src_download() {
 	:;
 }
@@ -19,12 +29,3 @@ animation_pre_src_download() {
 animation_post_src_download() {
 	:;
 }
-
-if [[ "$(uname -mso)" == "Linux aarch64 Android" ]]; then
-	VSHA256SUM=$(realpath bin/vsha256sum-aarch64-linux-android)
-elif [[ "$(uname -mso)" == "Linux x86_64 GNU/Linux" ]]; then
-	VSHA256SUM=$(realpath bin/vsha256sum-x86_64-linux-gnu)
-else
-	echo "unsupported machine for $(uname -mso)"
-	exit 1
-fi
@@ -4,13 +4,19 @@ set -e
 source ./config.sh
 source ../cuts.sh
 
+# flattens the frames given as arguments, or all of them
+frames=("$@")
+if [[ ${#frames[@]} -eq 0 ]]; then
+	frames=($(seq -f "%"${ANIMATION_BUILD_FRAMES_ZEROS}g 0 $ANIMATION_FRAMES))
+fi
+
 pushd ..
-mkdir flattened credits
+mkdir -p flattened credits
 
 
 
 # first, flatten the animation frames
-for f in $(seq -f "%"${ANIMATION_BUILD_FRAMES_ZEROS}g 0 $ANIMATION_FRAMES); do
+for f in ${frames[@]}; do
 	(
 	for c in ${cuts[@]}; do
 		if [ -f "$c/$f.png" ]; then
@@ -20,7 +26,9 @@ for f in $(seq -f "%"${ANIMATION_BUILD_FRAMES_ZEROS}g 0 $ANIMATION_FRAMES); do
 		fi
 	done
 	echo FLATTEN $f
-	$IM_CONVERT $(cat layers-${f}.txt) -colorspace RGB -flatten flattened/$f.png
+	# renamed once complete, so no reader sees half a frame
+	$IM_CONVERT $(cat layers-${f}.txt) -colorspace RGB -flatten flattened/.$f.png
+	mv flattened/.$f.png flattened/$f.png
 #	rm $(cat layers-${f}.txt)
 	rm layers-${f}.txt
 	) &
@@ -0,0 +1,56 @@
+#!/bin/bash
+set -eo pipefail
+
+# Packs the frames of a cut into a seekable tar.zst. Every file becomes
+# its own zstd frame, in name order, and a trailing zstd skippable frame
+# indexes where each one starts, so fflatten and retrieve.sh can jump
+# straight to a frame or decompress slices of the cut in parallel. zstd
+# ignores skippable frames, so the result still extracts with
+# "tar --zstd -xf".
+#
+# index frame: magic 0x184D2A5E, payload size, then one line per member
+#     <compressed offset> <compressed size> <name>
+# and at last "fftar-index <bytes of the whole index frame>", 24 bytes
+# wide so readers can find it from the end of the file.
+#
+# usage: ./newarchive.sh <frames directory> <output.tar.zst>
+
+if [[ $# -ne 2 ]]; then
+	echo "usage: $0 <frames directory> <output.tar.zst>"
+	exit 1
+fi
+
+src=$1
+out=$(realpath "$2")
+TAR=$(which tar)
+ZSTD=$(which zstd)
+
+le32() {
+	printf "\\\\x%02x\\\\x%02x\\\\x%02x\\\\x%02x" \
+		$(( $1 & 255 )) $(( $1 >> 8 & 255 )) $(( $1 >> 16 & 255 )) $(( $1 >> 24 & 255 ))
+}
+
+: > "$out"
+index=""
+pushd "$src" > /dev/null
+while IFS= read -r f; do
+	offset=$(stat -c %s "$out")
+	# one ustar member, without the two blocks ending the archive
+	$TAR --format=ustar --owner=0 --group=0 --numeric-owner -b 1 -cf - -- "$f" | \
+		head -c -1024 | $ZSTD -q -c >> "$out"
+	index+="$offset $(( $(stat -c %s "$out") - offset )) $f"$'\n'
+done < <(find . -type f -printf '%P\n' | LC_ALL=C sort)
+popd > /dev/null
+
+# end of archive, for plain zstd -d | tar -x
+head -c 1024 /dev/zero | $ZSTD -q -c >> "$out"
+
+# in bytes, ${#index} would count characters of non-ASCII names
+payload=$(( $(printf "%s" "$index" | LC_ALL=C wc -c) + 24 ))
+{
+	printf "$(le32 $(( 0x184D2A5E )))$(le32 $payload)"
+	printf "%s" "$index"
+	printf "fftar-index %011d\n" $(( payload + 8 ))
+} >> "$out"
+
+echo "$out: $(printf "%s" "$index" | wc -l) frames"
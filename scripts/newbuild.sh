@@ -17,11 +17,20 @@ BUILD_FRAMES_STARTING_FRAME="0000"
 BUILD_FRAMES_SRCURL="https://example.com/file.tar.zst"
 
 # What file format is the frames stored into? (zip, tar.zst, tar.gz)
+# a tar.zst packed with ./newarchive.sh <frames directory> file.tar.zst
+# is seekable, so single frames can be read without the whole cut
 BUILD_FRAMES_SRCFORMAT="tar.zst"
 
 # sha256sum of the source (tar/zip)
 BUILD_FRAMES_SRCSHA256=""
 
+# optional. verify the source in chunks so that nothing unverified is
+# extracted. create the chunk list with
+#   vsha256sum -M 4194304 chunks.sha256 < file.tar.zst
+# copy it next to the new build.sh and set the root it prints here
+BUILD_FRAMES_SRCCHUNKS="chunks.sha256"
+BUILD_FRAMES_SRCROOT256=""
+
 # license
 BUILD_FRAMES_LICENSE="CC0"
 
@@ -39,6 +48,10 @@ echo "BUILD_FRAMES_STARTING_FRAME=\"$BUILD_FRAMES_STARTING_FRAME\""  >> ../$buil
 echo "BUILD_FRAMES_SRCURL=\"$BUILD_FRAMES_SRCURL\""                  >> ../$builddir/build.sh
 echo "BUILD_FRAMES_SRCFORMAT=\"$BUILD_FRAMES_SRCFORMAT\""            >> ../$builddir/build.sh
 echo "BUILD_FRAMES_SRCSHA256=\"$BUILD_FRAMES_SRCSHA256\""            >> ../$builddir/build.sh
+if [[ -n "$BUILD_FRAMES_SRCROOT256" ]]; then
+echo "BUILD_FRAMES_SRCCHUNKS=\"$BUILD_FRAMES_SRCCHUNKS\""            >> ../$builddir/build.sh
+echo "BUILD_FRAMES_SRCROOT256=\"$BUILD_FRAMES_SRCROOT256\""          >> ../$builddir/build.sh
+fi
 echo "BUILD_FRAMES_LICENSE=\"$BUILD_FRAMES_LICENSE\""                >> ../$builddir/build.sh
 
 echo "../$builddir and its build.sh has been created."
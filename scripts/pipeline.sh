@@ -0,0 +1,157 @@
+#!/bin/bash
+set -eo pipefail
+
+# retrieve.sh, fflatten and compile.sh run as one pipeline: a frame is
+# flattened as soon as every cut covering it has extracted it, and frames
+# are encoded in order as soon as they are flattened.
+#
+# cuts are assumed to be packed in frame order (tar --sort=name), so a
+# cut that has extracted frame N has no layers left for any frame <= N.
+
+# waiting for the fflatten behind a process substitution came with bash 4.4
+if (( BASH_VERSINFO[0] * 100 + BASH_VERSINFO[1] < 404 )); then
+	echo "pipeline.sh needs bash 4.4 or later, this is $BASH_VERSION"
+	exit 1
+fi
+
+source ./config.sh
+source ../cuts.sh
+
+FLATTEN_JOBS="${FLATTEN_JOBS:-$(nproc)}"
+
+if [[ ! -x src/fflatten ]]; then
+	echo "src/fflatten is missing, build it with: make -C src fflatten"
+	exit 1
+fi
+
+events=$(mktemp -u)
+mkfifo "$events"
+# held open for reading and writing, so the fifo never hits EOF between
+# the writers of retrieve.sh
+exec 3<> "$events"
+
+pids=()
+cleanup() {
+	exec 3>&-
+	rm -f "$events"
+	kill ${pids[@]} 2> /dev/null || true
+}
+trap cleanup EXIT
+
+declare -A start last done
+for c in ${cuts[@]}; do
+	start[$c]=$(source ../$c/build.sh; echo $(( 10#$BUILD_FRAMES_STARTING_FRAME )))
+	last[$c]=-1
+	done[$c]=0
+done
+
+frame() {
+	printf "%${ANIMATION_BUILD_FRAMES_ZEROS}d" $1
+}
+
+# whether no cut has layers left to extract for frame $1
+ready() {
+	for c in ${cuts[@]}; do
+		if (( ! done[$c] && start[$c] <= $1 && last[$c] < $1 )); then
+			return 1
+		fi
+	done
+}
+
+# the fflatten -b line of frame $1: its output, then the layers of every
+# cut that has one, bottom to top, each over the last
+layers() {
+	local f=$(frame $1) chain=() c
+	for c in ${cuts[@]}; do
+		if [[ -f ../$c/$f.png ]]; then
+			if (( ${#chain[@]} )); then
+				chain+=(" ")
+			fi
+			chain+=("../$c/$f.png")
+		fi
+	done
+	if (( ! ${#chain[@]} )); then
+		echo "frame $f has no layers in any cut" >&2
+		return 1
+	fi
+	local IFS=$'\t'
+	echo "../flattened/$f.png$IFS${chain[*]}"
+}
+
+# hands frames to the encoder in order, as fflatten completes them
+feed() {
+	for (( f = 0; f <= ANIMATION_FRAMES; f++ )); do
+		png=../flattened/$(frame $f).png
+		while [[ ! -f $png ]]; do
+			if ! kill -0 $$ 2> /dev/null; then
+				exit 1
+			fi
+			sleep 0.1
+		done
+		cat "$png"
+	done
+}
+
+# frames left over from an earlier run would be encoded right away
+mkdir -p ../flattened
+rm -f ../flattened/[0-9]*.png
+
+{
+	status=0
+	RETRIEVE_EVENTS="$events" ./retrieve.sh || status=$?
+	echo "retrieved - $status" >> "$events"
+} &
+pids+=($!)
+
+feed | ./compile.sh - &
+encoder=$!
+pids+=($encoder)
+
+# one fflatten takes frames as they are ready, flattening each as it
+# comes and writing it out on FLATTEN_JOBS encoder threads
+exec 4> >(FFLATTEN_JOBS=$FLATTEN_JOBS src/fflatten -b -)
+flattener=$!
+pids+=($flattener)
+
+next=0
+while read -r ev c name <&3; do
+	case $ev in
+	extracted)
+		n=${name%.png}
+		if [[ $n =~ ^[0-9]+$ ]] && (( 10#$n > last[$c] )); then
+			last[$c]=$(( 10#$n ))
+		fi
+		;;
+	done)
+		done[$c]=1
+		;;
+	retrieved)
+		if [[ $name != 0 ]]; then
+			echo "retrieve.sh failed with $name"
+			exit 1
+		fi
+		# a cut that failed may have left retrieve.sh's status alone,
+		# its frames would then be flattened without its layers
+		for c in ${cuts[@]}; do
+			if (( ! done[$c] )); then
+				echo "cut $c was never retrieved"
+				exit 1
+			fi
+		done
+		;;
+	esac
+
+	while (( next <= ANIMATION_FRAMES )) && ready $next; do
+		layers $next >&4
+		next=$(( next + 1 ))
+	done
+
+	if [[ $ev == retrieved ]]; then
+		break
+	fi
+done
+
+exec 4>&-
+wait $flattener
+wait $encoder
+echo "PIPELINE frames=$next elapsed=$SECONDS"
@@ -4,49 +4,199 @@ set -eo pipefail
 source ./config.sh
 source ../cuts.sh
 
+# built from src/, see setup-linux.sh
+if [[ ! -x src/vsha256sum ]]; then
+	echo "src/vsha256sum is missing, build it with: make -C src vsha256sum"
+	exit 1
+fi
+VSHA256SUM=$(realpath src/vsha256sum)
+
 
 # default src format
 BUILD_FRAMES_SRCFORMAT="tar.zst"
 
+# with RETRIEVE_EVENTS set, every cut appends "extracted <cut> <file>"
+# per extracted file and "done <cut>" once it is complete to that file
+# (see pipeline.sh)
+event() {
+	if [[ -n "$RETRIEVE_EVENTS" ]]; then
+		echo "$1 $c $2" >> "$RETRIEVE_EVENTS"
+	fi
+}
+
+# tar -v names a member as it starts extracting it, so a member is only
+# complete once the next one is named or tar has exited
+extracted() {
+	local prev= name
+	while IFS= read -r name; do
+		if [[ -n "$prev" ]]; then
+			event extracted "$prev"
+		fi
+		prev=$name
+	done
+	if [[ -n "$prev" ]]; then
+		event extracted "$prev"
+	fi
+}
+
+# prints the "<offset> <size> <member>" lines indexing the zstd frames of
+# a cut packed by newarchive.sh, or fails if it was not
+seekable_index() {
+	local tail=$(tail -c 24 "$1")
+	if [[ ! $tail =~ ^fftar-index\ ([0-9]{11})$ ]]; then
+		return 1
+	fi
+	tail -c $(( 10#${BASH_REMATCH[1]} )) "$1" | tail -c +9 | head -n -1
+}
+
+# every frame of a seekable cut stands alone, so the archive is split into
+# EXTRACT_JOBS runs of frames that are decompressed side by side. members
+# finish out of order, hence no "extracted" events, only "done"
+extract_seekable() {
+	local offsets=() sizes=() pids=() line i j n status=0
+	while read -r line; do
+		read -r offsets[${#offsets[@]}] sizes[${#sizes[@]}] _ <<< "$line"
+	done < <(seekable_index "$1")
+	n=${#offsets[@]}
+	for (( i = 0; i < EXTRACT_JOBS && i < n; i++ )); do
+		local first=$(( i * n / EXTRACT_JOBS )) last=$(( (i + 1) * n / EXTRACT_JOBS ))
+		local len=0
+		for (( j = first; j < last; j++ )); do
+			len=$(( len + sizes[j] ))
+		done
+		tail -c +$(( offsets[first] + 1 )) "$1" | head -c $len | $TAR --zstd -xf - &
+		pids+=($!)
+	done
+	for pid in ${pids[@]}; do
+		wait $pid || status=$?
+	done
+	return $status
+}
+
+# every cut is waited for by pid, so that any one failing fails the run
+pids=()
+status=0
 for c in ${cuts[@]}; do
 	(
 	pushd ../$c > /dev/null
 	source build.sh
+	nonce=$( printf "$BUILD_FRAMES_DESCRIPTION ${BUILD_FRAMES_AUTHOR[@]}" | sha256sum )
+	for author in "${BUILD_FRAMES_AUTHOR[@]}"; do
+		echo "$BUILD_FRAMES_STARTING_FRAME-${nonce:0:16}  $author"
+	done
+
+	# a cut whose extracted tree still matches the manifest written
+	# after its last extraction needs neither a download nor a tar
+	pin=${BUILD_FRAMES_SRCROOT256:-$BUILD_FRAMES_SRCSHA256}
+	if [[ "$(head -n 1 .extracted.sha256 2>/dev/null)" == "# $pin" ]] &&
+	   $VSHA256SUM -c .extracted.sha256 > /dev/null 2>&1; then
+		echo "UP TO DATE $c"
+		event done
+		exit 0
+	fi
+
 	animation_pre_src_download
 
 	# This is what we're only going to support throughout this
 	# upcoming future years. NO MORE. NO LESS.
 
+	# chunked sources are verified chunk by chunk before anything
+	# reaches the extractor. plain ones only at the end of the stream,
+	# but they are downloaded into $CITEST_CACHE/sha256/<sha256>.part,
+	# so a rerun after an interrupted transfer resumes where it stopped
+	# (vsha256sum -C), and once verified they are served from there.
+	blob="$CITEST_CACHE/sha256/$BUILD_FRAMES_SRCSHA256"
+	if [[ -n "$BUILD_FRAMES_SRCROOT256" ]]; then
+		fetch() {
+			$CURL -sL "$BUILD_FRAMES_SRCURL" | \
+				$VSHA256SUM -l $c -m ${BUILD_FRAMES_SRCCHUNKS:-chunks.sha256} $BUILD_FRAMES_SRCROOT256
+		}
+	elif [[ -f "$blob" ]]; then
+		echo "CACHED $c"
+		cached=1
+		fetch() {
+			$VSHA256SUM -l $c $BUILD_FRAMES_SRCSHA256 < "$blob"
+		}
+	else
+		mkdir -p "$CITEST_CACHE/sha256"
+		fetch() {
+			local offset=$(stat -c %s "$blob.part" 2>/dev/null || echo 0)
+			local status=(0 0)
+			$CURL -fsL -C $offset "$BUILD_FRAMES_SRCURL" | \
+				$VSHA256SUM -l $c -C "$blob.part" -o $offset $BUILD_FRAMES_SRCSHA256 ||
+				status=("${PIPESTATUS[@]}")
+			# a server that will not resume (33, or 22 for a 416) sent
+			# nothing, so vsha256sum wrote nothing: start over once
+			if (( offset > 0 && (status[0] == 33 || status[0] == 22) )); then
+				echo "RESTART $c, the server did not resume" >&2
+				rm -f "$blob.part" "$blob.part.ckpt"
+				fetch
+				return
+			fi
+			# curl got to the end, so the blob is whole and wrong: the
+			# next run starts over. a failed transfer is resumed instead
+			if (( status[0] == 0 && status[1] != 0 )); then
+				rm -f "$blob.part" "$blob.part.ckpt"
+			fi
+			return ${status[1]}
+		}
+	fi
+
 	# the use of zip is highly discouraged since it's used
 	# result to SIGPIPE. Better to use tar.
 	if [[ "$BUILD_FRAMES_SRCFORMAT" == "zip" ]]; then
 		echo "CURL $c | VSHA256SUM > >(BUSYBOX UNZIP)"
-		$CURL -sL "$BUILD_FRAMES_SRCURL" | \
-			$VSHA256SUM $BUILD_FRAMES_SRCSHA256 > >(dd | $BUSYBOX unzip -)
+		fetch > >(dd | $BUSYBOX unzip -)
+	elif [[ "$BUILD_FRAMES_SRCFORMAT" == "tar.zst" && -n "$cached" ]] &&
+	     seekable_index "$blob" > /dev/null; then
+		# a verified blob is on disk, so nothing is extracted before
+		# the whole of it is checked
+		echo "VSHA256SUM $c && TAR ZSTD x$EXTRACT_JOBS"
+		fetch > /dev/null
+		extract_seekable "$blob"
+		sliced=1
 	elif [[ "$BUILD_FRAMES_SRCFORMAT" == "tar.zst" ]]; then
 		echo "CURL $c | VSHA256SUM > >(TAR ZSTD)"
-		$CURL -sL "$BUILD_FRAMES_SRCURL" | \
-			$VSHA256SUM $BUILD_FRAMES_SRCSHA256 > >($TAR --zstd -xf -)
+		fetch > >($TAR --zstd -xvf - | extracted)
 	elif [[ "$BUILD_FRAMES_SRCFORMAT" == "tar.gz" ]]; then
 		echo "CURL $c | VSHA256SUM > >(TAR GZIP)"
-		$CURL -sL "$BUILD_FRAMES_SRCURL" | \
-			$VSHA256SUM $BUILD_FRAMES_SRCSHA256 > >($TAR --gzip -xvf -)
+		fetch > >($TAR --gzip -xvf - | extracted)
 	else
 		echo "invalid frames format: \"$BUILD_FRAMES_SRCFORMAT\""
 		exit 1
 	fi
-	nonce=$( printf "$BUILD_FRAMES_DESCRIPTION ${BUILD_FRAMES_AUTHOR[@]}" | sha256sum )
-	for author in "${BUILD_FRAMES_AUTHOR[@]}"; do
-		echo "$BUILD_FRAMES_STARTING_FRAME-${nonce:0:16}  $author"
-	done
+	# wait for the extractor behind the process substitution
+	if [[ -z "$sliced" ]]; then
+		wait $!
+	fi
+	if [[ -f "$blob.part" ]]; then
+		mv "$blob.part" "$blob"
+	fi
+
+	{
+		echo "# $pin"
+		find . -type f ! -name build.sh ! -name '.*' \
+			! -name "${BUILD_FRAMES_SRCCHUNKS:-chunks.sha256}" -printf '%P\0' | \
+			xargs -0 -r sha256sum
+	} > .extracted.sha256
 
 	animation_post_src_download
+	event done
 	popd > /dev/null
 	) &
+	pids+=($!)
 
-	if [[ $(jobs -r -p | wc -l) -ge 1 ]]; then
-		wait -n
+	if (( ${#pids[@]} >= RETRIEVE_JOBS )); then
+		wait ${pids[0]} || status=1
+		pids=("${pids[@]:1}")
 	fi
 done
-wait
+for pid in ${pids[@]}; do
+	wait $pid || status=1
+done
+
+# per cut throughput is in the "vsha256sum: label=<cut> event=done"
+# lines above
+echo "RETRIEVE jobs=$RETRIEVE_JOBS cuts=${#cuts[@]} elapsed=$SECONDS"
+exit $status
 
@@ -1,3 +1,5 @@
+#!/bin/bash
+set -e
 
 if [[ "$(uname -mso)" == "Linux "*" Android" ]]; then
 	SUDO=
@@ -15,4 +17,15 @@ PACKAGES+=" zstd"
 PACKAGES+=" tar"
 #PACKAGES+=" yt-dlp"
 PACKAGES+=" gnupg"
+PACKAGES+=" gcc"
+PACKAGES+=" make"
+PACKAGES+=" libpng-dev"
+PACKAGES+=" zlib1g-dev"
 yes | $SUDO apt install $PACKAGES
+
+# wider hashing lanes on x86_64, see src/Makefile
+if [[ "$(uname -m)" == x86_64 ]]; then
+	make -C src VSHA256SUM_NATIVE=1 vsha256sum fflatten
+else
+	make -C src vsha256sum fflatten
+fi
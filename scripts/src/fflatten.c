@@ -18,13 +18,27 @@
  *
  */
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <assert.h>
 #include <time.h>
 #include <png.h>
+#include <zlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef FFLATTEN_ENABLE_ZSTD
+#  include <zstd.h>
+#endif
 
 
 #define FFMAX(a, b, c) ( a > b ? (a > c ? a : c): ((b > c) ? b : c))
@@ -131,6 +145,15 @@ static inline float32x4_t vminq_f32(float32x4_t a, float32x4_t b) {
   };
 }
 
+static inline float32x4_t vmaxq_f32(float32x4_t a, float32x4_t b) {
+  return (float32x4_t){
+    a.x > b.x ? a.x : b.x,
+    a.y > b.y ? a.y : b.y,
+    a.z > b.z ? a.z : b.z,
+    a.w > b.w ? a.w : b.w
+  };
+}
+
 static inline float32x4_t vbslq_f32(uint32x4_t mask, float32x4_t a,
                                     float32x4_t b) {
   float x = (mask.x ? a.x : b.x), y = (mask.y ? a.y : b.y);
@@ -267,25 +290,112 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
 
 #define PRINT_BLEND_OP(x) printf("  '%c'         %s\n", BLEND_##x, #x) 
 
-/* base class for all blend modes */
-#define DEFINE_BLEND_FUNC(name)                                                  \
-  static void blend_##name(imgf32_t *restrict base, imgf32_t *restrict top) {    \
-    for (uint32_t y = 0; y < base->height; y++) {                                \
-      float32_t *brow = base->rows[y];                                           \
-      float32_t *trow = top->rows[y];                                            \
-      for (uint32_t x = 0; x < base->width; x++) {                               \
+/* base class for all blend modes. a blend body reads the alpha of base
+ * and top as ba and ta; a variant knowing either to be opaque has it as
+ * the constant 1, which folds away its loads and multiplies, and FFCS
+ * skips the mix with the top that an opaque base never takes
+ */
+#define DEFINE_BLEND_VARIANT(name, suffix, OPACITY, BOPAQUE, TOPAQUE)            \
+  static void blend_##name##suffix(imgf32_t *restrict base,                      \
+                                   imgf32_t *restrict top) {                     \
+    const int bopaque = BOPAQUE;                                                 \
+    (void)bopaque;                                                               \
+    const int adjust = top->gen != NULL && ffgen_adjusts(top->gen);              \
+    ffrect_t r = blend_rect(base, top);                                          \
+    float32_t *grow = NULL;                                                      \
+    if (top->gen != NULL || top->scale != 0.0) {                                 \
+      grow = malloc(sizeof(*grow) * 4 * (r.x1 - r.x0));                          \
+      assert(grow != NULL);                                                      \
+    }                                                                            \
+    for (uint32_t y = 0; y < r.y1 - r.y0; y++) {                                 \
+      float32_t *brow = base->rows[r.y0 + y] + r.x0 * 4;                         \
+      float32_t *trow =                                                          \
+        top->gen != NULL ?                                                       \
+          ffgen_row(top->gen, grow, brow, r.tx, r.ty + y, r.x1 - r.x0) :         \
+        top->scale != 0.0 ?                                                      \
+          ffsample_row(top, grow, r.tx, r.ty + y, r.x1 - r.x0) :                 \
+        top->rows[r.ty + y] + r.tx * 4;                                          \
+      for (uint32_t x = 0; x < r.x1 - r.x0; x++) {                               \
         float32_t *(bpx) = (void *)(brow + x * 4);                               \
         float32_t *(tpx) = (void *)(trow + x * 4);                               \
-        bpx[3] *= base->opacity;                                                 \
-        tpx[3] *= top->opacity;                                                  \
+        float32_t tcopy[4];                                                      \
+        if (OPACITY) {                                                           \
+          bpx[3] *= base->opacity;                                               \
+          /* the top may be held for the next frame, see flatten_range */        \
+          vst1q_f32(tcopy, vld1q_f32(tpx));                                      \
+          tcopy[3] *= top->opacity;                                              \
+          tpx = tcopy;                                                           \
+        }                                                                        \
+        /* an adjustment mixes with the composite as if it were opaque */        \
+        const float32_t ba = BOPAQUE || adjust ? 1.0 : bpx[3];                   \
+        const float32_t ta = TOPAQUE ? 1.0 : tpx[3];                             \
+        (void)ba; (void)ta;                                                      \
+        const float32_t cover = bpx[3];                                          \
         BLEND_BODY_##name;                                                       \
+        /* adjustments change colours, not coverage, see ffgen_row */            \
+        if (adjust)                                                              \
+          bpx[3] = cover;                                                        \
       }                                                                          \
     }                                                                            \
+    free(grow);                                                                  \
     base->opacity = 1.0;                                                         \
   }
 
-#define DEFINE_BLEND_CASE(name, base, top)                     \
-  case BLEND_##name: blend_##name(base, top); break
+/* blend_<name> applies opacities, the others expect them folded in already
+ * (see rowu8_f32): _a for any alpha, _b for an opaque base, _t for an opaque
+ * top and _bt for both
+ */
+#define DEFINE_BLEND_FUNC(name)                                                  \
+  DEFINE_BLEND_VARIANT(name,    , 1, 0, 0)                                       \
+  DEFINE_BLEND_VARIANT(name, _a , 0, 0, 0)                                       \
+  DEFINE_BLEND_VARIANT(name, _b , 0, 1, 0)                                       \
+  DEFINE_BLEND_VARIANT(name, _t , 0, 0, 1)                                       \
+  DEFINE_BLEND_VARIANT(name, _bt, 0, 1, 1)
+
+/* picks the cheapest variant valid for the pair, then tells whether the
+ * result is opaque: BLEND_OPAQUE_<name>(base opaque, top opaque)
+ */
+#define DEFINE_BLEND_CASE(name, base, top)                                       \
+  case BLEND_##name: {                                                           \
+    int bo = base->opaque && base->opacity == 1.0;                               \
+    int to = top->opaque && top->opacity == 1.0 && top->scale == 0.0;            \
+    if (base->opacity != 1.0 || top->opacity != 1.0)                             \
+      blend_##name(base, top);                                                   \
+    else if (bo && to)                                                           \
+      blend_##name##_bt(base, top);                                              \
+    else if (bo)                                                                 \
+      blend_##name##_b(base, top);                                               \
+    else if (to)                                                                 \
+      blend_##name##_t(base, top);                                               \
+    else                                                                         \
+      blend_##name##_a(base, top);                                               \
+    base->opaque = top->gen != NULL && ffgen_adjusts(top->gen) ? bo :            \
+                   BLEND_OPAQUE_##name(bo, to) &&                                \
+                   (bo || blend_covers(base, top));                              \
+    break;                                                                       \
+  }
+
+// bodies ending with bpx[3] = 1.0 always leave the base opaque
+#define BLEND_OPAQUE_BASE(bo, to)        (bo)
+#define BLEND_OPAQUE_TOP(bo, to)         (to)
+#define BLEND_OPAQUE_ADDITION(bo, to)    ((bo) || (to))
+#define BLEND_OPAQUE_GAMMA_LIGHT(bo, to) 0
+#define BLEND_OPAQUE_DIVIDE(bo, to)      0
+#define BLEND_OPAQUE_LUMINOSITY(bo, to)  0
+#define BLEND_OPAQUE_NORMAL(bo, to)      1
+#define BLEND_OPAQUE_COLOR(bo, to)       1
+#define BLEND_OPAQUE_COLOR_DODGE(bo, to) 1
+#define BLEND_OPAQUE_DIFFERENCE(bo, to)  1
+#define BLEND_OPAQUE_DARKEN(bo, to)      1
+#define BLEND_OPAQUE_GAMMA_DARK(bo, to)  1
+#define BLEND_OPAQUE_HUE(bo, to)         1
+#define BLEND_OPAQUE_LIGHTEN(bo, to)     1
+#define BLEND_OPAQUE_MULTIPLY(bo, to)    1
+#define BLEND_OPAQUE_OVERLAY(bo, to)     1
+#define BLEND_OPAQUE_SATURATION(bo, to)  1
+#define BLEND_OPAQUE_SCREEN(bo, to)      1
+#define BLEND_OPAQUE_SOFT_LIGHT(bo, to)  1
+#define BLEND_OPAQUE_HARD_LIGHT(bo, to)  1
 
 /* Apply the blend in place
  * 
@@ -295,11 +405,13 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
  * Co = αs x Fa x Cs + αb x Fb x Cb
  */
 
-#define FFCS(B) vaddq_f32(vmulq_n_f32(freg_top, 1.0-bpx[3]), vmulq_n_f32(B, bpx[3]))
+#define FFCS(B)                                                 \
+  (bopaque ? (B) :                                              \
+   vaddq_f32(vmulq_n_f32(freg_top, 1.0-ba), vmulq_n_f32(B, ba)))
 /* Fa and Fb, porter-duff values */
 #define FFCO(Fa, Fb, B)                       \
-  vaddq_f32(vmulq_n_f32(FFCS(B), Fa* tpx[3]), \
-            vmulq_n_f32(freg_base, Fb* bpx[3]))
+  vaddq_f32(vmulq_n_f32(FFCS(B), Fa* ta),     \
+            vmulq_n_f32(freg_base, Fb* ba))
 
 /* When writing a blend body, only intrinsics are allowed
  * and branching is prohibited. 
@@ -321,9 +433,9 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
   do {                                                         \
     float32x4_t freg_base = vld1q_f32(bpx);                    \
     float32x4_t freg_top = vld1q_f32(tpx);                     \
-    freg_base = FFCO(1.0, (1.0 - tpx[3]), freg_top);           \
+    freg_base = FFCO(1.0, (1.0 - ta), freg_top);               \
     vst1q_f32(bpx, freg_base);                                 \
-    bpx[3] = 1.0; \
+    bpx[3] = 1.0;                                              \
   } while (0)
 
 #define BLEND_BODY_ADDITION                                    \
@@ -351,10 +463,10 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
       vrecpeq_f32(vsubq_f32(ffour_ones, freg_top));            \
     float32x4_t freg_min =                                     \
       vminq_f32(ffour_ones, vmulq_f32(freg_base, freg_rec));   \
-    freg_base = FFCO(1.0, 1.0-tpx[3], vbslq_f32(freg_eq0,      \
+    freg_base = FFCO(1.0, 1.0 - ta, vbslq_f32(freg_eq0,        \
       ffour_zeros, vbslq_f32(freg_eq1, ffour_ones, freg_min)));\
     vst1q_f32(bpx, freg_base);                                 \
-    bpx[3] = 1.0; \
+    bpx[3] = 1.0;                                              \
   } while (0)
 
 #define BLEND_BODY_DIFFERENCE                                  \
@@ -371,10 +483,10 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_dif = vsubq_f32(freg_max, freg_min);      \
     float32x4_t freg_abs = vabsq_f32(freg_dif);                \
     mask = vcgtq_f32(freg_abs, ffour_ones);                    \
-    freg_base = FFCO(1.0, 1.0 - tpx[3],                        \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       vbslq_f32(mask, ffour_ones, freg_abs));                  \
     vst1q_f32(bpx, freg_base);                                 \
-    bpx[3] = 1.0; \
+    bpx[3] = 1.0;                                              \
   } while (0)
 
 #define BLEND_BODY_SCREEN                                      \
@@ -383,7 +495,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_base = vld1q_f32(bpx);                    \
     float32x4_t freg_top = vld1q_f32(tpx);                     \
     float32x4_t freg_screen = FFSCREEN(freg_base, freg_top);   \
-    freg_base = FFCO(1.0, 1.0-tpx[3], freg_screen);            \
+    freg_base = FFCO(1.0, 1.0 - ta, freg_screen);              \
     uint32x4_t mask = vcgtq_f32(freg_base, ffour_ones);        \
     freg_base = vbslq_f32(mask, ffour_ones, freg_base);        \
     vst1q_f32(bpx, freg_base);                                 \
@@ -401,7 +513,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_screen = FFSCREEN(freg_base,              \
       vsubq_f32(vmulq_n_f32(freg_top, 2.0), ffour_ones));      \
     uint32x4_t mask = vcltq_f32(freg_top, ffour_halfs);        \
-    freg_base = FFCO(1.0, 1.0-tpx[3],                          \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       vbslq_f32(mask, freg_mult, freg_screen));                \
     vst1q_f32(bpx, freg_base);                                 \
     bpx[3] = 1.0;                                              \
@@ -419,7 +531,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_screen = FFSCREEN(freg_top,               \
       vsubq_f32(vmulq_n_f32(freg_base, 2.0), ffour_ones));     \
     uint32x4_t mask = vcltq_f32(freg_base, ffour_halfs);       \
-    freg_base = FFCO(1.0, 1.0-tpx[3],                          \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       vbslq_f32(mask, freg_mult, freg_screen));                \
     vst1q_f32(bpx, freg_base);                                 \
     bpx[3] = 1.0;                                              \
@@ -453,7 +565,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
             vsubq_f32(vbslq_f32(mask, freg_d025, freg_e025), freg_base)));    \
     mask = vcleq_f32(freg_top, ffour_halfs);                                  \
     freg_base =                                                               \
-        FFCO(1.0, 1.0 - tpx[3], vbslq_f32(mask, freg_d050, freg_e050));       \
+        FFCO(1.0, 1.0 - ta, vbslq_f32(mask, freg_d050, freg_e050));           \
     vst1q_f32(bpx, freg_base);                                                \
     bpx[3] = 1.0;                                                             \
   } while (0)
@@ -464,7 +576,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_base = vld1q_f32(bpx);                    \
     float32x4_t freg_top = vld1q_f32(tpx);                     \
     uint32x4_t mask = vcltq_f32(freg_top, freg_base);          \
-    freg_base = FFCO(1.0, 1.0-tpx[3],                          \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       vbslq_f32(mask, freg_top, freg_base));                   \
     vst1q_f32(bpx, freg_base);                                 \
     bpx[3] = 1.0;                                              \
@@ -475,7 +587,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
   do {                                                         \
     float32x4_t freg_base = vld1q_f32(bpx);                    \
     float32x4_t freg_top = vld1q_f32(tpx);                     \
-    freg_base = FFCO(1.0, 1.0-tpx[3],                          \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       ffvpowq_f32(freg_base, freg_top));                       \
     vst1q_f32(bpx, freg_base);                                 \
   } while (0)
@@ -488,7 +600,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     uint32x4_t mask = vceqq_f32(freg_top, ffour_zeros);        \
     float32x4_t freg_gdark = vbslq_f32(mask, ffour_zeros,      \
       ffvpowq_f32(freg_base, vrecpeq_f32(freg_top)));          \
-    freg_base = FFCO(1.0, 1.0-tpx[3], freg_gdark);             \
+    freg_base = FFCO(1.0, 1.0 - ta, freg_gdark);               \
     vst1q_f32(bpx, freg_base);                                 \
     bpx[3] = 1.0;                                              \
   } while (0)
@@ -498,7 +610,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_base = vld1q_f32(bpx);                    \
     float32x4_t freg_top = vld1q_f32(tpx);                     \
     uint32x4_t mask = vcgtq_f32(freg_top, freg_base);          \
-    freg_base = FFCO(1.0, 1.0-tpx[3],                          \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       vbslq_f32(mask, freg_top, freg_base));                   \
     vst1q_f32(bpx, freg_base);                                 \
     bpx[3] = 1.0;                                              \
@@ -512,7 +624,7 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_rec = vrecpeq_f32(freg_top);              \
     float32x4_t freg_mul = vmulq_f32(freg_base, freg_rec);     \
     uint32x4_t mask = vcgtq_f32(freg_mul, ffour_ones);         \
-    freg_base = FFCO(1.0, 1.0-tpx[3],                          \
+    freg_base = FFCO(1.0, 1.0 - ta,                            \
       vbslq_f32(mask, ffour_ones, freg_mul));                  \
     vst1q_f32(bpx, freg_base);                                 \
   } while (0)
@@ -522,9 +634,9 @@ static inline float32x4_t ffvpowq_f32(float32x4_t a, float32x4_t b) {
     float32x4_t freg_base = vld1q_f32(bpx);                    \
     float32x4_t freg_top = vld1q_f32(tpx);                     \
     float32x4_t freg_tmp = FFMULTIPLY(freg_base, freg_top);    \
-    freg_base = FFCO(1.0, (1.0 - tpx[3]), freg_tmp);           \
+    freg_base = FFCO(1.0, (1.0 - ta), freg_tmp);               \
     vst1q_f32(bpx, freg_base);                                 \
-    bpx[3] = 1.0;\
+    bpx[3] = 1.0;                                              \
   } while (0)
 
 
@@ -637,12 +749,17 @@ static inline float32x4_t set_sat(float32x4_t rgb, float32_t s) {
 
 // XXX NON-SEPARABLE BLEND MODES
 
+/* a layer's :opacity reaches these as coverage only, through ta and ba,
+ * as in the separable modes. scaling the colours by it too would darken
+ * the lum and sat taken from a faded layer instead of fading it
+ */
+
 #define BLEND_BODY_COLOR                                                \
   do {                                                                  \
     float32x4_t freg_base = vld1q_f32(bpx);                             \
     float32x4_t freg_top = vld1q_f32(tpx);                              \
     freg_base =                                                         \
-        FFCO(1.0, 1.0 - tpx[3], set_lum(freg_top, rgb2lum(freg_base))); \
+        FFCO(1.0, 1.0 - ta, set_lum(freg_top, rgb2lum(freg_base)));     \
     vst1q_f32(bpx, freg_base);                                          \
     bpx[3] = 1.0;                                                       \
   } while (0)
@@ -652,7 +769,7 @@ static inline float32x4_t set_sat(float32x4_t rgb, float32_t s) {
     float32x4_t freg_base = vld1q_f32(bpx);                                  \
     float32x4_t freg_top = vld1q_f32(tpx);                                   \
     freg_base = FFCO(                                                        \
-        1.0, 1.0 - tpx[3],                                                   \
+        1.0, 1.0 - ta,                                                       \
         set_lum(set_sat(freg_top, rgb2sat(freg_base)), rgb2lum(freg_base))); \
     vst1q_f32(bpx, freg_base);                                               \
     bpx[3] = 1.0;                                                            \
@@ -662,10 +779,8 @@ static inline float32x4_t set_sat(float32x4_t rgb, float32_t s) {
   do {                                                                       \
     float32x4_t freg_base = vld1q_f32(bpx);                                  \
     float32x4_t freg_top = vld1q_f32(tpx);                                   \
-    freg_base = vmulq_n_f32(freg_base, base->opacity);                       \
-    freg_top = vmulq_n_f32(freg_top, top->opacity);                          \
     freg_base = FFCO(                                                        \
-        1.0, 1.0 - tpx[3],                                                   \
+        1.0, 1.0 - ta,                                                       \
         set_lum(set_sat(freg_base, rgb2sat(freg_top)), rgb2lum(freg_base))); \
     vst1q_f32(bpx, freg_base);                                               \
     bpx[3] = 1.0;                                                            \
@@ -675,19 +790,26 @@ static inline float32x4_t set_sat(float32x4_t rgb, float32_t s) {
   do {                                                                  \
     float32x4_t freg_base = vld1q_f32(bpx);                             \
     float32x4_t freg_top = vld1q_f32(tpx);                              \
-    freg_base = vmulq_n_f32(freg_base, base->opacity);                  \
-    freg_top = vmulq_n_f32(freg_top, top->opacity);                     \
     freg_base =                                                         \
-        FFCO(1.0, 1.0 - tpx[3], set_lum(freg_base, rgb2lum(freg_top))); \
+        FFCO(1.0, 1.0 - ta, set_lum(freg_base, rgb2lum(freg_top)));     \
     vst1q_f32(bpx, freg_base);                                          \
   } while (0)
 
+typedef struct ffgen_t ffgen_t;
+static void ffgen_free(ffgen_t *g);
+static int ffgen_adjusts(const ffgen_t *g);
+
 /* Four channels RGBA, normalized */
 typedef struct imgf32_t imgf32_t;
 struct imgf32_t {
   uint32_t width, height;
   float opacity;
+  int opaque; // every alpha is 1, see DEFINE_BLEND_CASE
+  int32_t x, y; // where a top goes on the base, see blend_rect
+  float32_t fx, fy, scale; // or these, when scale is not 0, see ffsample_row
+  uint32_t pad; // transparent pixels around it, from its effects
   float32_t **rows;
+  ffgen_t *gen; // rows are computed instead, see ffgen_row
 };
 
 typedef struct imgu8_t imgu8_t;
@@ -768,6 +890,11 @@ static inline float32x4_t hsl2rgb(float32x4_t hsl) {
 
     
 void free_imgf32(imgf32_t *img) {
+  if (img->gen != NULL) {
+    ffgen_free(img->gen);
+    free(img);
+    return;
+  }
   for (uint32_t y = 0; y < img->height; y++)
     free(img->rows[y]);
   free(img->rows);
@@ -783,6 +910,430 @@ void free_imgu8(imgu8_t *img) {
   free(img);
 }
 
+/* Proxy renders (--scale 1/2 or 1/4) shrink every layer by ffproxy as it
+ * is decoded, see ffsink_row. positions on the canvas shrink along
+ */
+static uint32_t ffproxy = 1;
+
+/* Generator layers are computed as they are blended, a row at a time,
+ * and cover any canvas:
+ *   #rrggbb[aa]                          a solid colour
+ *   grad:linear:x0,y0,x1,y1:#from:#to    from at x0,y0 to at x1,y1
+ *   grad:radial:x,y,r:#from:#to          from at x,y to at r pixels away
+ * past either end a gradient keeps the colour of that end. any of these
+ * may end with :opacity as a file does, #000000:0.5 or levels:0,0.9:0.5
+ *
+ * Adjustment layers are generated too, from the colours of the composite
+ * under them as the row is blended, so grading takes no pass of its own:
+ *   levels:black,white[,gamma[,out black,out white]]   0..1 each
+ *   curves:x,y/x,y/...[:green points:blue points]      one for every channel
+ *                                                      or red, green and blue
+ *   hsl:hue,saturation,lightness         hue turned by degrees, the others added
+ * levels and curves are a lookup table per channel, built once.
+ */
+#define FFGEN_SIZE ((uint32_t)INT32_MAX)
+
+#define FFLUT_SIZE 4096
+#define FFCURVE_MAX 16
+
+struct ffgen_t {
+  char kind; // 's'olid, 'l'inear, 'r'adial, 'c'urves or levels, 'h'sl
+  float32x4_t from, to; // the hsl shift in from
+  float32_t x, y, dx, dy, r;
+  float32_t *lut; // FFLUT_SIZE per channel, curves and levels
+};
+
+static void ffgen_free(ffgen_t *g) {
+  free(g->lut);
+  free(g);
+}
+
+// levels, curves and hsl keep the alpha of the composite
+static int ffgen_adjusts(const ffgen_t *g) {
+  return g->kind == 'c' || g->kind == 'h';
+}
+
+static int ffgen_is(const char *spec) {
+  return spec[0] == '#' || !strncmp(spec, "grad:", 5) ||
+         !strncmp(spec, "levels:", 7) || !strncmp(spec, "curves:", 7) ||
+         !strncmp(spec, "hsl:", 4);
+}
+
+static int ffgen_color(const char *str, float32x4_t *color) {
+  unsigned int c[4] = {0, 0, 0, 255};
+  int end = 0;
+  size_t len = strlen(str);
+  if ((len != 7 && len != 9) ||
+      sscanf(str, "#%2x%2x%2x%n", &c[0], &c[1], &c[2], &end) != 3 ||
+      (len == 9 && sscanf(str + end, "%2x", &c[3]) != 1))
+    return -1;
+  *color = (float32x4_t){c[0], c[1], c[2], c[3]};
+  *color = vmulq_n_f32(*color, 1.0/255.0);
+  return 0;
+}
+
+static void ffgen_levels(float32_t *lut, float32_t black, float32_t white,
+                         float32_t gamma, float32_t oblack, float32_t owhite) {
+  for (uint32_t i = 0; i < FFLUT_SIZE; i++) {
+    float32_t v = ((float32_t)i / (FFLUT_SIZE - 1) - black) / (white - black);
+    v = v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v;
+    lut[i] = oblack + (owhite - oblack) * powf(v, 1.0f / gamma);
+  }
+}
+
+/* a curve through the n points of str, x,y/x,y/... with x growing, as a
+ * monotone cubic (Fritsch-Carlson) so it does not overshoot between them.
+ * returns the length of str used, 0 if it is no curve
+ */
+static int ffgen_curve(float32_t *lut, const char *str) {
+  float32_t px[FFCURVE_MAX], py[FFCURVE_MAX], d[FFCURVE_MAX], m[FFCURVE_MAX];
+  int n = 0, used = 0, end;
+  for (; n < FFCURVE_MAX; n++) {
+    if (sscanf(str + used, "%f,%f%n", &px[n], &py[n], &end) != 2 ||
+        (n > 0 && px[n] <= px[n - 1]))
+      return 0;
+    used += end;
+    if (str[used] != '/') {
+      n++;
+      break;
+    }
+    used++;
+  }
+  if (n < 2 || (str[used] != '\0' && str[used] != ':'))
+    return 0;
+
+  for (int k = 0; k < n - 1; k++)
+    d[k] = (py[k + 1] - py[k]) / (px[k + 1] - px[k]);
+  m[0] = d[0];
+  m[n - 1] = d[n - 2];
+  for (int k = 1; k < n - 1; k++)
+    m[k] = d[k - 1] * d[k] <= 0.0f ? 0.0f : (d[k - 1] + d[k]) / 2.0f;
+  for (int k = 0; k < n - 1; k++) {
+    if (d[k] == 0.0f) {
+      m[k] = m[k + 1] = 0.0f;
+      continue;
+    }
+    float32_t a = m[k] / d[k], b = m[k + 1] / d[k];
+    if (a * a + b * b > 9.0f) {
+      float32_t t = 3.0f / sqrtf(a * a + b * b);
+      m[k] = t * a * d[k];
+      m[k + 1] = t * b * d[k];
+    }
+  }
+
+  for (uint32_t i = 0, k = 0; i < FFLUT_SIZE; i++) {
+    float32_t x = (float32_t)i / (FFLUT_SIZE - 1), y;
+    while (k < (uint32_t)n - 2 && x > px[k + 1])
+      k++;
+    if (x <= px[0]) {
+      y = py[0];
+    } else if (x >= px[n - 1]) {
+      y = py[n - 1];
+    } else {
+      float32_t h = px[k + 1] - px[k], t = (x - px[k]) / h;
+      float32_t t2 = t * t, t3 = t2 * t;
+      y = (2 * t3 - 3 * t2 + 1) * py[k] + (t3 - 2 * t2 + t) * h * m[k] +
+          (-2 * t3 + 3 * t2) * py[k + 1] + (t3 - t2) * h * m[k + 1];
+    }
+    lut[i] = y < 0.0f ? 0.0f : y > 1.0f ? 1.0f : y;
+  }
+  return used;
+}
+
+// curves or levels into g->lut
+static int ffgen_adjust(ffgen_t *g, const char *spec) {
+  float32_t v[5] = {0.0, 1.0, 1.0, 0.0, 1.0};
+  int end = 0, n;
+  g->kind = 'c';
+  g->lut = malloc(sizeof(*g->lut) * 3 * FFLUT_SIZE);
+  assert(g->lut != NULL);
+  if (!strncmp(spec, "levels:", 7)) {
+    n = sscanf(spec, "levels:%f,%f%n,%f%n,%f,%f%n", &v[0], &v[1], &end,
+               &v[2], &end, &v[3], &v[4], &end);
+    if ((n != 2 && n != 3 && n != 5) || spec[end] || v[1] <= v[0] ||
+        v[2] <= 0.0f)
+      return -1;
+    ffgen_levels(g->lut, v[0], v[1], v[2], v[3], v[4]);
+    memcpy(g->lut + FFLUT_SIZE, g->lut, sizeof(*g->lut) * FFLUT_SIZE);
+    memcpy(g->lut + 2 * FFLUT_SIZE, g->lut, sizeof(*g->lut) * FFLUT_SIZE);
+    return 0;
+  }
+  const char *str = spec + 7;
+  for (n = 0; n < 3; n++) {
+    if (!(end = ffgen_curve(g->lut + n * FFLUT_SIZE, str)))
+      return -1;
+    str += end;
+    if (*str == '\0')
+      break;
+    str++;
+  }
+  if (n == 0) {
+    memcpy(g->lut + FFLUT_SIZE, g->lut, sizeof(*g->lut) * FFLUT_SIZE);
+    memcpy(g->lut + 2 * FFLUT_SIZE, g->lut, sizeof(*g->lut) * FFLUT_SIZE);
+    return 0;
+  }
+  return n == 2 && *str == '\0' ? 0 : -1;
+}
+
+/* splits the :opacity off the end of a generator spec, where no colour
+ * (#) or list of numbers (,) is. returns it, or NULL if there is none
+ */
+static char *ffgen_opacity(char *spec) {
+  char *colon = strrchr(spec, ':');
+  if (colon == NULL || (spec[0] != '#' && colon == strchr(spec, ':')) ||
+      colon[1] == '#' || strchr(colon, ',') != NULL)
+    return NULL;
+  *colon = '\0';
+  return colon + 1;
+}
+
+static imgf32_t *ffgen_open(const char *str) {
+  ffgen_t g = {0};
+  char spec[PATH_MAX], from[16], to[16];
+  float32_t x1, y1;
+  float opacity = 1.0;
+  int end = 0, ok = 0;
+  snprintf(spec, sizeof(spec), "%s", str);
+  char *fade = ffgen_opacity(spec);
+  if (fade != NULL)
+    opacity = atof(fade);
+  if (spec[0] == '#') {
+    g.kind = 's';
+    ok = !ffgen_color(spec, &g.from);
+    g.to = g.from;
+  } else if (sscanf(spec, "grad:linear:%f,%f,%f,%f:%15[^:]:%15s%n",
+                    &g.x, &g.y, &x1, &y1, from, to, &end) == 6 && !spec[end]) {
+    g.kind = 'l';
+    g.dx = x1 - g.x;
+    g.dy = y1 - g.y;
+    ok = (g.dx != 0 || g.dy != 0) &&
+         !ffgen_color(from, &g.from) && !ffgen_color(to, &g.to);
+  } else if (sscanf(spec, "grad:radial:%f,%f,%f:%15[^:]:%15s%n",
+                    &g.x, &g.y, &g.r, from, to, &end) == 5 && !spec[end]) {
+    g.kind = 'r';
+    ok = g.r > 0 && !ffgen_color(from, &g.from) && !ffgen_color(to, &g.to);
+  } else if (!strncmp(spec, "levels:", 7) || !strncmp(spec, "curves:", 7)) {
+    ok = !ffgen_adjust(&g, spec);
+  } else if (sscanf(spec, "hsl:%f,%f,%f%n", &g.x, &g.y, &g.r, &end) == 3 &&
+             !spec[end]) {
+    g.kind = 'h';
+    g.from = (float32x4_t){g.x / 360.0f, g.y, g.r, 0.0};
+    g.x = g.y = g.r = 0.0;
+    ok = 1;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: not a colour, gradient or adjustment\n", str);
+    free(g.lut);
+    return NULL;
+  }
+  g.x /= ffproxy;
+  g.y /= ffproxy;
+  g.dx /= ffproxy;
+  g.dy /= ffproxy;
+  g.r /= ffproxy;
+
+  imgf32_t *ret = malloc(sizeof(*ret));
+  ffgen_t *gen = malloc(sizeof(*gen));
+  if (ret == NULL || gen == NULL) {
+    fprintf(stderr, "no mem\n");
+    abort();
+  }
+  *gen = g;
+  ret->width = ret->height = FFGEN_SIZE;
+  ret->opacity = opacity;
+  // adjustments are opaque, the op blends them as a solid colour
+  ret->opaque = ffgen_adjusts(&g) ||
+                (vgetq_lane_f32(g.from, 3) == 1.0 &&
+                 vgetq_lane_f32(g.to, 3) == 1.0);
+  ret->x = ret->y = 0;
+  ret->scale = 0.0;
+  ret->pad = 0;
+  ret->rows = NULL;
+  ret->gen = gen;
+  return ret;
+}
+
+// n pixels of row y from column x into out, which it returns
+// n pixels from x,y, over the n of under for adjustments
+static float32_t *ffgen_row(const ffgen_t *g, float32_t *out,
+                            const float32_t *under, uint32_t x, uint32_t y,
+                            uint32_t n) {
+  if (g->kind == 'c') {
+    for (uint32_t i = 0; i < n * 4; i++) {
+      if (i % 4 == 3) {
+        out[i] = 1.0f;
+        continue;
+      }
+      // linear between the entries
+      float32_t v = under[i] < 0.0f ? 0.0f : under[i] > 1.0f ? 1.0f : under[i];
+      float32_t at = v * (FFLUT_SIZE - 1);
+      uint32_t k = at < FFLUT_SIZE - 1 ? (uint32_t)at : FFLUT_SIZE - 2;
+      const float32_t *lut = g->lut + i % 4 * FFLUT_SIZE + k;
+      out[i] = lut[0] + (lut[1] - lut[0]) * (at - k);
+      out[i] = out[i] > 1.0f ? 1.0f : out[i];
+    }
+    return out;
+  }
+  if (g->kind == 'h') {
+    for (uint32_t i = 0; i < n; i++) {
+      float32x4_t hsl = vaddq_f32(rgb2hsl(vld1q_f32((float32_t *)under + i * 4)),
+                                  g->from);
+      float32_t h = vgetq_lane_f32(hsl, 0), s = vgetq_lane_f32(hsl, 1);
+      float32_t l = vgetq_lane_f32(hsl, 2);
+      h -= floorf(h);
+      s = s < 0.0f ? 0.0f : s > 1.0f ? 1.0f : s;
+      l = l < 0.0f ? 0.0f : l > 1.0f ? 1.0f : l;
+      float32x4_t rgb = hsl2rgb((float32x4_t){h, s, l, 1.0});
+      vst1q_f32(out + i * 4, vminq_f32(rgb, (float32x4_t){1.0, 1.0, 1.0, 1.0}));
+    }
+    return out;
+  }
+  const float32x4_t span = vsubq_f32(g->to, g->from);
+  // pixel centers
+  float32_t px = x + 0.5f - g->x, py = y + 0.5f - g->y;
+  float32_t t = 0.0, step = 0.0;
+  if (g->kind == 'l') {
+    float32_t len2 = g->dx * g->dx + g->dy * g->dy;
+    t = (px * g->dx + py * g->dy) / len2;
+    step = g->dx / len2;
+  }
+  for (uint32_t i = 0; i < n; i++, px++, t += step) {
+    float32_t s = t;
+    if (g->kind == 'r')
+      s = sqrtf(px * px + py * py) / g->r;
+    s = s < 0.0f ? 0.0f : s > 1.0f ? 1.0f : s;
+    vst1q_f32(out + i * 4, vaddq_f32(g->from, vmulq_n_f32(span, s)));
+  }
+  return out;
+}
+
+/* Tops placed at a fraction of a pixel or scaled are resampled as they
+ * are blended, a row at a time like the generators: bilinear, or
+ * Catmull-Rom bicubic with FFLATTEN_FILTER=bicubic. Taps are weighted
+ * by their alpha, so transparent pixels do not darken the edges, and
+ * past the edges the image is transparent.
+ */
+static int ffsample_cubic;
+
+static inline void ffsample_weights(float32_t t, float32_t *w) {
+  if (!ffsample_cubic) {
+    w[0] = 1.0f - t;
+    w[1] = t;
+    return;
+  }
+  float32_t t2 = t * t, t3 = t2 * t;
+  w[0] = 0.5f * (-t3 + 2.0f * t2 - t);
+  w[1] = 0.5f * (3.0f * t3 - 5.0f * t2 + 2.0f);
+  w[2] = 0.5f * (-3.0f * t3 + 4.0f * t2 + t);
+  w[3] = 0.5f * (t3 - t2);
+}
+
+// n pixels of row y of the base from column x into out, which it returns
+static float32_t *ffsample_row(const imgf32_t *img, float32_t *out, uint32_t x,
+                               uint32_t y, uint32_t n) {
+  const int taps = ffsample_cubic ? 4 : 2;
+  const float32_t inv = 1.0f / img->scale;
+  const float32x4_t zero = {0.0, 0.0, 0.0, 0.0};
+  float32_t v = (y + 0.5f - img->fy) * inv - 0.5f, wy[4];
+  int32_t v0 = (int32_t)floorf(v) - (taps / 2 - 1);
+  ffsample_weights(v - floorf(v), wy);
+
+  for (uint32_t i = 0; i < n; i++) {
+    float32_t u = (x + i + 0.5f - img->fx) * inv - 0.5f, wx[4];
+    int32_t u0 = (int32_t)floorf(u) - (taps / 2 - 1);
+    ffsample_weights(u - floorf(u), wx);
+    float32x4_t sum = zero;
+    float32_t alpha = 0.0;
+    for (int j = 0; j < taps; j++) {
+      if (v0 + j < 0 || v0 + j >= (int32_t)img->height)
+        continue;
+      float32_t *row = img->rows[v0 + j];
+      for (int k = 0; k < taps; k++) {
+        if (u0 + k < 0 || u0 + k >= (int32_t)img->width)
+          continue;
+        float32_t *spx = row + (u0 + k) * 4;
+        float32_t w = wy[j] * wx[k] * spx[3];
+        sum = vaddq_f32(sum, vmulq_n_f32(vld1q_f32(spx), w));
+        alpha += w;
+      }
+    }
+
+    float32_t *dpx = out + i * 4;
+    vst1q_f32(dpx, alpha > 0.0f ? vmulq_n_f32(sum, 1.0f / alpha) : zero);
+    // bicubic overshoots
+    for (int c = 0; c < 3; c++)
+      dpx[c] = dpx[c] < 0.0f ? 0.0f : dpx[c] > 1.0f ? 1.0f : dpx[c];
+    dpx[3] = alpha < 0.0f ? 0.0f : alpha > 1.0f ? 1.0f : alpha;
+  }
+  return out;
+}
+
+// puts a top at x,y of the base, scaled. whole pixels need no resampling
+static void imgf32_place(imgf32_t *img, float32_t x, float32_t y,
+                         float32_t scale) {
+  // the padding of effects goes past x,y, as far as the top is scaled
+  x = x / ffproxy - img->pad * scale;
+  y = y / ffproxy - img->pad * scale;
+  if (scale == 1.0f && x == floorf(x) && y == floorf(y) &&
+      fabsf(x) < INT32_MAX && fabsf(y) < INT32_MAX) {
+    img->x = x;
+    img->y = y;
+    img->scale = 0.0;
+  } else {
+    img->x = img->y = 0;
+    img->fx = x;
+    img->fy = y;
+    img->scale = scale;
+  }
+}
+
+/* where top lands on base: columns x0..x1 and rows y0..y1 of the base,
+ * starting at column tx and row ty of the top. empty when they miss.
+ * for a resampled top, tx and ty are x0 and y0
+ */
+typedef struct ffrect_t ffrect_t;
+struct ffrect_t {
+  uint32_t x0, y0, x1, y1, tx, ty;
+};
+
+static ffrect_t blend_rect(const imgf32_t *base, const imgf32_t *top) {
+  if (top->scale != 0.0) {
+    // every pixel a tap of the filter reaches, as in ffsample_row
+    float32_t reach = ffsample_cubic ? 1.5f : 0.5f;
+    float32_t x0 = floorf(top->fx - top->scale * reach - 0.5f);
+    float32_t y0 = floorf(top->fy - top->scale * reach - 0.5f);
+    float32_t x1 = ceilf(top->fx + top->scale * (top->width + reach) + 0.5f);
+    float32_t y1 = ceilf(top->fy + top->scale * (top->height + reach) + 0.5f);
+    x0 = x0 > 0 ? x0 : 0;
+    y0 = y0 > 0 ? y0 : 0;
+    x1 = x1 < base->width ? x1 : base->width;
+    y1 = y1 < base->height ? y1 : base->height;
+    x1 = x1 > x0 ? x1 : x0;
+    y1 = y1 > y0 ? y1 : y0;
+    return (ffrect_t){x0, y0, x1, y1, x0, y0};
+  }
+  int64_t x0 = top->x > 0 ? top->x : 0;
+  int64_t y0 = top->y > 0 ? top->y : 0;
+  int64_t x1 = (int64_t)top->x + top->width;
+  int64_t y1 = (int64_t)top->y + top->height;
+  if (x1 > base->width)
+    x1 = base->width;
+  if (y1 > base->height)
+    y1 = base->height;
+  if (x1 < x0)
+    x1 = x0;
+  if (y1 < y0)
+    y1 = y0;
+  return (ffrect_t){x0, y0, x1, y1, x0 - top->x, y0 - top->y};
+}
+
+// whether top is over every pixel of base
+static int blend_covers(const imgf32_t *base, const imgf32_t *top) {
+  ffrect_t r = blend_rect(base, top);
+  return r.x0 == 0 && r.y0 == 0 &&
+         r.x1 == base->width && r.y1 == base->height;
+}
+
 /* blend functions. these forward declarations are what functions those DEFINE_BLEND_FUNC()
  * are going to expand to. those macros are discouraged but it keeps this source minimal.
  */
@@ -829,41 +1380,302 @@ DEFINE_BLEND_FUNC(SATURATION);
 DEFINE_BLEND_FUNC(SOFT_LIGHT);
 DEFINE_BLEND_FUNC(HARD_LIGHT);
 
-// u8 -> f32
-imgf32_t *imgu8_f32(imgu8_t *src) {
-  float32_t **dst = malloc(sizeof(*dst) * src->height);
-  if (dst == NULL) {
-    fprintf(stderr, "no mem\n");
-    return NULL;
+/* Fused chains blend several tops in one pass, the base pixel living in
+ * acc from the first layer to the last and stored once. opacities must be
+ * folded in already, and every top the size of the base and unplaced, or
+ * generated (see fused_rows).
+ */
+#define FFFUSE_MAX 4
+
+#define FUSE_STEP(name, k)                                                       \
+  do {                                                                           \
+    imgf32_t *top = tops[k];                                                     \
+    float32_t *(tpx) = top->rows[y] + x * 4;                                     \
+    const float32_t ba = bpx[3], ta = tpx[3];                                    \
+    (void)ba; (void)ta;                                                          \
+    BLEND_BODY_##name;                                                           \
+  } while (0)
+
+#define FUSE_LOOP(...)                                                           \
+  const int bopaque = 0;                                                         \
+  (void)bopaque;                                                                 \
+  for (uint32_t y = 0; y < base->height; y++) {                                  \
+    float32_t *brow = base->rows[y];                                             \
+    for (uint32_t x = 0; x < base->width; x++) {                                 \
+      float32_t acc[4];                                                          \
+      float32_t *(bpx) = acc;                                                    \
+      vst1q_f32(acc, vld1q_f32(brow + x * 4));                                   \
+      __VA_ARGS__;                                                               \
+      vst1q_f32(brow + x * 4, vld1q_f32(acc));                                   \
+    }                                                                            \
   }
 
-  for (uint32_t y = 0; y < src->height; y++) {
-    dst[y] = malloc(sizeof(**dst) * 4 * src->width);
-    assert(dst[y] != NULL);
+// a kernel for one chain of ops, spelled as on the command line
+#define DEFINE_FUSED_FUNC(fname, ...)                                            \
+  static void fused_##fname(imgf32_t *restrict base,                             \
+                            imgf32_t *const *restrict tops) {                    \
+    FUSE_LOOP(__VA_ARGS__)                                                       \
   }
 
-  for (uint32_t y = 0; y < src->height; y++) {
-    float32_t *drow = dst[y];
-    uint8_t *srow = src->rows[y];
-    for (uint32_t x = 0; x < src->width; x++) {
-      float32_t *dpx = drow + x*4;
-      uint8_t *spx = srow + x*4;
-      float32x4_t freg_src = {
-        (float32_t)spx[0], (float32_t)spx[1],
-        (float32_t)spx[2], (float32_t)spx[3]
-      };
-      freg_src = vmulq_n_f32(freg_src, 1.0/255.0);
-      vst1q_f32(dpx, freg_src);
+#define FUSE_CASE(name)                                                          \
+  case BLEND_##name:                                                             \
+    FUSE_STEP(name, k);                                                          \
+    break
+
+// any other chain of valid ops, one switch per layer and pixel
+static void fused_generic(imgf32_t *restrict base,
+                          imgf32_t *const *restrict tops,
+                          const char *ops, int n) {
+  FUSE_LOOP(
+    for (int k = 0; k < n; k++) {
+      switch (ops[k]) {
+      FUSE_CASE(BASE);
+      FUSE_CASE(TOP);
+      FUSE_CASE(NORMAL);
+      FUSE_CASE(ADDITION);
+      FUSE_CASE(COLOR);
+      FUSE_CASE(COLOR_DODGE);
+      FUSE_CASE(DIFFERENCE);
+      FUSE_CASE(DARKEN);
+      FUSE_CASE(DIVIDE);
+      FUSE_CASE(GAMMA_LIGHT);
+      FUSE_CASE(GAMMA_DARK);
+      FUSE_CASE(HUE);
+      FUSE_CASE(LIGHTEN);
+      FUSE_CASE(LUMINOSITY);
+      FUSE_CASE(MULTIPLY);
+      FUSE_CASE(OVERLAY);
+      FUSE_CASE(SATURATION);
+      FUSE_CASE(SCREEN);
+      FUSE_CASE(SOFT_LIGHT);
+      FUSE_CASE(HARD_LIGHT);
+      }
+    })
+}
+
+/* the chains our cuts are made of: stacks of plain layers, as flatten.sh
+ * does, and the shading recipe (fill, multiply shadows, screen lights,
+ * line art)
+ */
+DEFINE_FUSED_FUNC(NN,
+  FUSE_STEP(NORMAL, 0); FUSE_STEP(NORMAL, 1))
+DEFINE_FUSED_FUNC(NNN,
+  FUSE_STEP(NORMAL, 0); FUSE_STEP(NORMAL, 1); FUSE_STEP(NORMAL, 2))
+DEFINE_FUSED_FUNC(NNNN,
+  FUSE_STEP(NORMAL, 0); FUSE_STEP(NORMAL, 1); FUSE_STEP(NORMAL, 2);
+  FUSE_STEP(NORMAL, 3))
+DEFINE_FUSED_FUNC(NM,
+  FUSE_STEP(NORMAL, 0); FUSE_STEP(MULTIPLY, 1))
+DEFINE_FUSED_FUNC(MS,
+  FUSE_STEP(MULTIPLY, 0); FUSE_STEP(SCREEN, 1))
+DEFINE_FUSED_FUNC(NMSN,
+  FUSE_STEP(NORMAL, 0); FUSE_STEP(MULTIPLY, 1); FUSE_STEP(SCREEN, 2);
+  FUSE_STEP(NORMAL, 3))
+
+static const struct {
+  const char *ops;
+  void (*kernel)(imgf32_t *restrict, imgf32_t *const *restrict);
+} fused_kernels[] = {
+  {"  ", fused_NN},
+  {"   ", fused_NNN},
+  {"    ", fused_NNNN},
+  {" *", fused_NM},
+  {"*c", fused_MS},
+  {" *c ", fused_NMSN},
+};
+
+/* chains with a generated top go a row at a time instead: each top in
+ * turn over the row, which stays in cache from the first to the last, and
+ * generated rows are computed over it as blend_<name> does, adjustments
+ * from the row as it stands. a pixel at a time, the generator calls would
+ * cost more than the pass they save
+ */
+#define FUSE_ROW_CASE(name)                                                      \
+  case BLEND_##name:                                                             \
+    for (uint32_t x = 0; x < base->width; x++) {                                 \
+      float32_t *(bpx) = brow + x * 4;                                           \
+      float32_t *(tpx) = trow + x * 4;                                           \
+      const float32_t ba = adjust ? 1.0f : bpx[3], ta = tpx[3];                 \
+      const float32_t cover = bpx[3];                                            \
+      (void)ba; (void)ta;                                                        \
+      BLEND_BODY_##name;                                                         \
+      if (adjust)                                                                \
+        bpx[3] = cover;                                                          \
+    }                                                                            \
+    break
+
+static void fused_rows(imgf32_t *restrict base,
+                       imgf32_t *const *restrict tops,
+                       const char *ops, int n) {
+  const int bopaque = 0;
+  (void)bopaque;
+  float32_t *grow = malloc(sizeof(*grow) * 4 * base->width);
+  assert(grow != NULL);
+  for (uint32_t y = 0; y < base->height; y++) {
+    float32_t *brow = base->rows[y];
+    for (int k = 0; k < n; k++) {
+      const ffgen_t *gen = tops[k]->gen;
+      const int adjust = gen != NULL && ffgen_adjusts(gen);
+      float32_t *trow = gen != NULL ?
+        ffgen_row(gen, grow, brow, 0, y, base->width) : tops[k]->rows[y];
+      switch (ops[k]) {
+      FUSE_ROW_CASE(BASE);
+      FUSE_ROW_CASE(TOP);
+      FUSE_ROW_CASE(NORMAL);
+      FUSE_ROW_CASE(ADDITION);
+      FUSE_ROW_CASE(COLOR);
+      FUSE_ROW_CASE(COLOR_DODGE);
+      FUSE_ROW_CASE(DIFFERENCE);
+      FUSE_ROW_CASE(DARKEN);
+      FUSE_ROW_CASE(DIVIDE);
+      FUSE_ROW_CASE(GAMMA_LIGHT);
+      FUSE_ROW_CASE(GAMMA_DARK);
+      FUSE_ROW_CASE(HUE);
+      FUSE_ROW_CASE(LIGHTEN);
+      FUSE_ROW_CASE(LUMINOSITY);
+      FUSE_ROW_CASE(MULTIPLY);
+      FUSE_ROW_CASE(OVERLAY);
+      FUSE_ROW_CASE(SATURATION);
+      FUSE_ROW_CASE(SCREEN);
+      FUSE_ROW_CASE(SOFT_LIGHT);
+      FUSE_ROW_CASE(HARD_LIGHT);
+      }
+    }
+  }
+  free(grow);
+}
+
+// ops[0..n) over base in one pass, from the table or else interpreted, or
+// a row at a time when a top is generated
+static void blend_fused(imgf32_t *base, imgf32_t *const *tops,
+                        const char *ops, int n) {
+  for (int k = 0; k < n; k++)
+    if (tops[k]->gen != NULL) {
+      fused_rows(base, tops, ops, n);
+      return;
     }
+  for (size_t i = 0; i < sizeof(fused_kernels) / sizeof(*fused_kernels); i++)
+    if ((int)strlen(fused_kernels[i].ops) == n &&
+        memcmp(fused_kernels[i].ops, ops, n) == 0) {
+      fused_kernels[i].kernel(base, tops);
+      return;
+    }
+  fused_generic(base, tops, ops, n);
+}
+
+#define DEFINE_OPAQUE_CASE(name)                                                 \
+  case BLEND_##name:                                                             \
+    return BLEND_OPAQUE_##name(bo, to)
+
+// whether op leaves the base opaque, -1 for an invalid op
+static int blend_opaque(char op, int bo, int to) {
+  switch (op) {
+  DEFINE_OPAQUE_CASE(BASE);
+  DEFINE_OPAQUE_CASE(TOP);
+  DEFINE_OPAQUE_CASE(NORMAL);
+  DEFINE_OPAQUE_CASE(ADDITION);
+  DEFINE_OPAQUE_CASE(COLOR);
+  DEFINE_OPAQUE_CASE(COLOR_DODGE);
+  DEFINE_OPAQUE_CASE(DIFFERENCE);
+  DEFINE_OPAQUE_CASE(DARKEN);
+  DEFINE_OPAQUE_CASE(DIVIDE);
+  DEFINE_OPAQUE_CASE(GAMMA_LIGHT);
+  DEFINE_OPAQUE_CASE(GAMMA_DARK);
+  DEFINE_OPAQUE_CASE(HUE);
+  DEFINE_OPAQUE_CASE(LIGHTEN);
+  DEFINE_OPAQUE_CASE(LUMINOSITY);
+  DEFINE_OPAQUE_CASE(MULTIPLY);
+  DEFINE_OPAQUE_CASE(OVERLAY);
+  DEFINE_OPAQUE_CASE(SATURATION);
+  DEFINE_OPAQUE_CASE(SCREEN);
+  DEFINE_OPAQUE_CASE(SOFT_LIGHT);
+  DEFINE_OPAQUE_CASE(HARD_LIGHT);
+  default:
+    return -1;
   }
+}
+
+// a width x height image of opacity 1
+imgf32_t *alloc_imgf32(uint32_t width, uint32_t height) {
   imgf32_t *ret = malloc(sizeof(*ret));
-  ret->width = src->width;
-  ret->height = src->height;
-  ret->rows = dst;
+  float32_t **rows = malloc(sizeof(*rows) * height);
+  if (ret == NULL || rows == NULL) {
+    fprintf(stderr, "no mem\n");
+    abort();
+  }
+
+  for (uint32_t y = 0; y < height; y++) {
+    rows[y] = malloc(sizeof(**rows) * 4 * width);
+    assert(rows[y] != NULL);
+  }
+  ret->width = width;
+  ret->height = height;
+  ret->opacity = 1.0;
+  ret->opaque = 0;
+  ret->x = ret->y = 0;
+  ret->scale = 0.0;
+  ret->pad = 0;
+  ret->rows = rows;
+  ret->gen = NULL;
+  return ret;
+}
+
+// a copy of src with its opacity folded into alpha
+imgf32_t *dup_imgf32(const imgf32_t *src) {
+  imgf32_t *ret = alloc_imgf32(src->width, src->height);
+  for (uint32_t y = 0; y < src->height; y++) {
+    memcpy(ret->rows[y], src->rows[y], sizeof(**ret->rows) * 4 * src->width);
+    if (src->opacity != 1.0)
+      for (uint32_t x = 0; x < src->width; x++)
+        ret->rows[y][x * 4 + 3] *= src->opacity;
+  }
+  ret->opaque = src->opaque && src->opacity == 1.0;
+  ret->x = src->x;
+  ret->y = src->y;
+  ret->fx = src->fx;
+  ret->fy = src->fy;
+  ret->scale = src->scale;
+  ret->pad = src->pad;
   return ret;
 }
 
-// f32 -> u8
+/* box -> f32 of a proxy row, box holding the sums of rows source rows,
+ * see ffsink_row. colours are averaged by alpha, so transparent pixels
+ * do not darken the edges
+ */
+static void boxu32_f32(float32_t *restrict dst, const uint32_t *restrict box,
+                       uint32_t width, uint32_t srcw, uint32_t rows,
+                       float opacity) {
+  for (uint32_t x = 0; x < width; x++) {
+    const uint32_t *b = box + x * 4;
+    uint32_t cols = srcw - x * ffproxy < ffproxy ? srcw - x * ffproxy : ffproxy;
+    float32x4_t freg = {b[0], b[1], b[2], b[3]};
+    freg = vmulq_n_f32(freg, b[3] ? 1.0 / (255.0 * b[3]) : 0.0);
+    vst1q_f32(dst + x * 4, freg);
+    dst[x * 4 + 3] = b[3] * (1.0f / (255.0f * cols * rows)) * opacity;
+  }
+}
+
+/* u8 -> f32 of a row. opacity is folded into alpha here, so the layer
+ * reaches the blend with an opacity of 1
+ */
+static void rowu8_f32(float32_t *restrict dst, const uint8_t *restrict src,
+                      uint32_t width, float opacity) {
+  for (uint32_t x = 0; x < width; x++) {
+    float32_t *dpx = dst + x*4;
+    const uint8_t *spx = src + x*4;
+    float32x4_t freg_src = {
+      (float32_t)spx[0], (float32_t)spx[1],
+      (float32_t)spx[2], (float32_t)spx[3]
+    };
+    freg_src = vmulq_n_f32(freg_src, 1.0/255.0);
+    vst1q_f32(dpx, freg_src);
+    dpx[3] *= opacity;
+  }
+}
+
+// f32 -> u8, rounded to the nearest level so that float noise either
+// side of a level does not decide it
 imgu8_t *imgf32_u8(imgf32_t *src) {
   uint8_t **dst = malloc(sizeof(*dst) * src->height);
   if (dst == NULL) {
@@ -883,7 +1695,9 @@ imgu8_t *imgf32_u8(imgf32_t *src) {
       uint8_t *(dpx) = (drow + x * 4);
       float32_t *(spx) = (srow + x * 4);
       float32x4_t freg_src = vld1q_f32(spx);
-      freg_src = vmulq_n_f32(freg_src, 255.0);
+      freg_src = vaddq_n_f32(vmulq_n_f32(freg_src, 255.0), 0.5);
+      freg_src = vmaxq_f32(freg_src, (float32x4_t){0.0, 0.0, 0.0, 0.0});
+      freg_src = vminq_f32(freg_src, (float32x4_t){255.0, 255.0, 255.0, 255.0});
       uint32x4_t freg_dst = vcvtq_u32_f32(freg_src);
       dpx[0] = vgetq_lane_u32(freg_dst, 0) & 0xff;
       dpx[1] = vgetq_lane_u32(freg_dst, 1) & 0xff;
@@ -899,7 +1713,151 @@ imgu8_t *imgf32_u8(imgf32_t *src) {
   return ret;
 }
 
-void write_pngf32(imgf32_t *imgf, FILE *fp) {
+/* The composite may be resized for delivery (--resize WxH[:mitchell]),
+ * on its way to write_pngf32, so in batch mode on the encoder threads.
+ * Lanczos-3 or Mitchell-Netravali, separable: a pass over the rows into
+ * an image of the new width, then one over the columns, summing whole
+ * rows at a time. Both take the weights of an axis computed beforehand,
+ * and work on colours premultiplied by alpha.
+ */
+static uint32_t ffresize_width, ffresize_height;
+static int ffresize_mitchell;
+
+#define FFRESIZE_MAX 65535
+
+// a side of --resize WxH, from its digits on. 0 if it is none
+static uint32_t ffresize_dim(const char *str, char **end) {
+  *end = (char *)str;
+  if (*str < '0' || *str > '9')
+    return 0;
+  unsigned long v = strtoul(str, end, 10);
+  return v <= FFRESIZE_MAX ? v : 0;
+}
+
+typedef struct ffweights_t ffweights_t;
+struct ffweights_t {
+  uint32_t taps;
+  int32_t *first; // source pixel of the first tap, per output pixel
+  float32_t *w;   // taps weights per output pixel, 0 past the edges
+};
+
+static float32_t ffresize_kernel(float32_t x) {
+  x = fabsf(x);
+  if (ffresize_mitchell) {
+    const float32_t b = 1.0f / 3.0f, c = 1.0f / 3.0f;
+    if (x < 1.0f)
+      return ((12 - 9 * b - 6 * c) * x * x * x +
+              (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) / 6;
+    if (x < 2.0f)
+      return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x +
+              (-12 * b - 48 * c) * x + (8 * b + 24 * c)) / 6;
+    return 0.0f;
+  }
+  if (x < 1e-6f)
+    return 1.0f;
+  if (x >= 3.0f)
+    return 0.0f;
+  float32_t px = (float32_t)M_PI * x;
+  return 3.0f * sinf(px) * sinf(px / 3.0f) / (px * px);
+}
+
+static void ffweights_init(ffweights_t *fw, uint32_t src, uint32_t dst) {
+  float32_t scale = (float32_t)src / dst;
+  // downscaling stretches the kernel over the source
+  float32_t stretch = scale > 1.0f ? scale : 1.0f;
+  float32_t support = (ffresize_mitchell ? 2.0f : 3.0f) * stretch;
+  fw->taps = (uint32_t)ceilf(support) * 2 + 1;
+  fw->first = malloc(sizeof(*fw->first) * dst);
+  fw->w = malloc(sizeof(*fw->w) * dst * fw->taps);
+  assert(fw->first != NULL && fw->w != NULL);
+
+  for (uint32_t i = 0; i < dst; i++) {
+    float32_t center = (i + 0.5f) * scale - 0.5f, sum = 0.0f;
+    float32_t *w = fw->w + i * fw->taps;
+    fw->first[i] = (int32_t)floorf(center - support) + 1;
+    for (uint32_t k = 0; k < fw->taps; k++) {
+      int32_t s = fw->first[i] + k;
+      w[k] = s >= 0 && s < (int32_t)src ?
+             ffresize_kernel((s - center) / stretch) : 0.0f;
+      sum += w[k];
+    }
+    for (uint32_t k = 0; k < fw->taps && sum != 0.0f; k++)
+      w[k] /= sum;
+  }
+}
+
+/* a premultiplied pixel of a filtered image back to straight alpha, cut
+ * to 0..1
+ */
+static inline void ffunpremul(float32_t *px) {
+  float32_t a = px[3];
+  a = a < 0.0f ? 0.0f : a > 1.0f ? 1.0f : a;
+  vst1q_f32(px, vmulq_n_f32(vld1q_f32(px), a > 0.0f ? 1.0f / px[3] : 0.0f));
+  for (int c = 0; c < 3; c++)
+    px[c] = px[c] < 0.0f ? 0.0f : px[c] > 1.0f ? 1.0f : px[c];
+  px[3] = a;
+}
+
+// the tap's source pixel, any one in range for the ones weighing 0
+static inline uint32_t ffweights_at(const ffweights_t *fw, uint32_t i,
+                                    uint32_t k, uint32_t src) {
+  int32_t s = fw->first[i] + (int32_t)k;
+  return s < 0 ? 0 : s >= (int32_t)src ? src - 1 : (uint32_t)s;
+}
+
+// src resized to width x height, premultiplied on the way and back
+imgf32_t *resize_imgf32(const imgf32_t *src, uint32_t width, uint32_t height) {
+  ffweights_t fx, fy;
+  ffweights_init(&fx, src->width, width);
+  ffweights_init(&fy, src->height, height);
+  imgf32_t *tmp = alloc_imgf32(width, src->height);
+  imgf32_t *ret = alloc_imgf32(width, height);
+  float32_t *pre = malloc(sizeof(*pre) * 4 * src->width);
+  assert(pre != NULL);
+
+  for (uint32_t y = 0; y < src->height; y++) {
+    for (uint32_t x = 0; x < src->width; x++) {
+      float32_t *spx = src->rows[y] + x * 4;
+      vst1q_f32(pre + x * 4, vmulq_n_f32(vld1q_f32(spx), spx[3]));
+      pre[x * 4 + 3] = spx[3];
+    }
+    for (uint32_t x = 0; x < width; x++) {
+      const float32_t *w = fx.w + x * fx.taps;
+      float32x4_t sum = {0.0, 0.0, 0.0, 0.0};
+      for (uint32_t k = 0; k < fx.taps; k++)
+        sum = vaddq_f32(sum, vmulq_n_f32(
+          vld1q_f32(pre + ffweights_at(&fx, x, k, src->width) * 4), w[k]));
+      vst1q_f32(tmp->rows[y] + x * 4, sum);
+    }
+  }
+
+  for (uint32_t y = 0; y < height; y++) {
+    float32_t *drow = ret->rows[y];
+    const float32_t *w = fy.w + y * fy.taps;
+    memset(drow, 0, sizeof(*drow) * 4 * width);
+    for (uint32_t k = 0; k < fy.taps; k++) {
+      float32_t *trow = tmp->rows[ffweights_at(&fy, y, k, src->height)];
+      if (w[k] == 0.0f)
+        continue;
+      for (uint32_t x = 0; x < width; x++)
+        vst1q_f32(drow + x * 4, vaddq_f32(vld1q_f32(drow + x * 4),
+                  vmulq_n_f32(vld1q_f32(trow + x * 4), w[k])));
+    }
+    // back to straight alpha, and the lobes cut to 0..1
+    for (uint32_t x = 0; x < width; x++)
+      ffunpremul(drow + x * 4);
+  }
+
+  free(pre);
+  free_imgf32(tmp);
+  free(fx.first);
+  free(fx.w);
+  free(fy.first);
+  free(fy.w);
+  return ret;
+}
+
+static void encode_pngf32(imgf32_t *imgf, FILE *fp) {
   png_structp pstruct =
       png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (pstruct == NULL)
@@ -919,7 +1877,10 @@ void write_pngf32(imgf32_t *imgf, FILE *fp) {
                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
                PNG_FILTER_TYPE_DEFAULT);
   png_write_info(pstruct, pinfo);
-  png_set_compression_level(pstruct, 3);
+  // proxies are looked at once, spend nothing on their size
+  png_set_compression_level(pstruct, ffproxy > 1 ? 1 : 3);
+  if (ffproxy > 1)
+    png_set_filter(pstruct, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
 
   imgu8_t *imgu8 = imgf32_u8(imgf);
 
@@ -933,60 +1894,1113 @@ void write_pngf32(imgf32_t *imgf, FILE *fp) {
   return;
 }
 
-/* opens png file and stores its value to float32 */
-imgf32_t *open_pngf32(char *fstr) {
-  float opacity = 1.0;
-  char fpname[32] = {0};
-  for (unsigned int cndx = 0; cndx < 31 && cndx < strlen(fstr); cndx++) {
-    if (fstr[cndx] == ':') {
-      strncpy(fpname, fstr, cndx);
-      opacity = atof(fstr + cndx + 1);
-      break;
-    }
+void write_pngf32(imgf32_t *imgf, FILE *fp) {
+  if (ffresize_width == 0 || (ffresize_width == imgf->width &&
+                              ffresize_height == imgf->height)) {
+    encode_pngf32(imgf, fp);
+    return;
   }
-  if (!fpname[0]) {
-    strncpy(fpname, fstr, 31);
+  imgf32_t *resized = resize_imgf32(imgf, ffresize_width, ffresize_height);
+  encode_pngf32(resized, fp);
+  free_imgf32(resized);
+}
+
+/* Layers may be members of a cut archive, "cut.tar.zst#0012.png", so
+ * nothing has to be extracted to disk. The tar reader sits on top of
+ * zlib for .tar.gz, libzstd for .tar.zst (or a "zstd -dc" child when
+ * built without FFLATTEN_ENABLE_ZSTD) and plain stdio for .tar.
+ *
+ * Archives packed by newarchive.sh hold every member in its own zstd
+ * frame and end with an index of where each frame starts, so a member is
+ * read by decompressing its frame alone.
+ */
+#define FFTAR_BLOCK 512
+
+typedef struct ffstream_t ffstream_t;
+struct ffstream_t {
+  FILE *fp;
+  int popened;
+  gzFile gz;
+#ifdef FFLATTEN_ENABLE_ZSTD
+  ZSTD_DCtx *zd;
+  ZSTD_inBuffer in;
+  uint8_t *inbuf;
+#endif
+};
+
+/* every member header seen is remembered, so plain tars can seek straight
+ * to a member asked for again. members of a seekable archive come from its
+ * index instead, with coffset and csize locating their zstd frame
+ */
+typedef struct ffmember_t ffmember_t;
+struct ffmember_t {
+  char *name;
+  uint64_t offset, size;
+  int64_t coffset;
+  uint64_t csize;
+};
+
+typedef struct fftar_t fftar_t;
+struct fftar_t {
+  char *path;
+  ffmember_t *members;
+  size_t nmembers, alloc;
+  size_t *slots; // alloc * 2 of them, 1 + the member hashed there or 0
+  int probed;
+  fftar_t *next;
+};
+
+// layers are decoded concurrently, this guards fftar_index and its members
+static fftar_t *fftar_index = NULL;
+static pthread_mutex_t fftar_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* opens the archive at path, or only from the zstd frame at coffset on
+ * when coffset is not negative
+ */
+static int ffstream_open(ffstream_t *s, const char *path, int64_t coffset,
+                         uint64_t csize) {
+  uint8_t magic[4] = {0};
+  memset(s, 0, sizeof(*s));
+  s->fp = fopen(path, "rb");
+  if (s->fp == NULL) {
+    perror(path);
+    return -1;
   }
+  size_t l = fread(magic, 1, 4, s->fp);
+  rewind(s->fp);
+
+  if (l >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    fclose(s->fp);
+    s->fp = NULL;
+    s->gz = gzopen(path, "rb");
+    if (s->gz == NULL) {
+      perror(path);
+      return -1;
+    }
+    gzbuffer(s->gz, 128 * 1024);
+  } else if (l == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+             magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef FFLATTEN_ENABLE_ZSTD
+    s->zd = ZSTD_createDCtx();
+    s->inbuf = malloc(ZSTD_DStreamInSize());
+    assert(s->zd != NULL && s->inbuf != NULL);
+    s->in = (ZSTD_inBuffer){s->inbuf, 0, 0};
+    if (coffset >= 0 && fseeko(s->fp, coffset, SEEK_SET)) {
+      perror(path);
+      return -1;
+    }
+    (void)csize;
+#else
+    char cmd[PATH_MAX + 96];
+    fclose(s->fp);
+    if (strchr(path, '\'') != NULL) {
+      fprintf(stderr, "%s: unsupported archive name\n", path);
+      s->fp = NULL;
+      return -1;
+    }
+    if (coffset >= 0)
+      snprintf(cmd, sizeof(cmd),
+               "tail -c +%" PRId64 " -- '%s' | head -c %" PRIu64 " | zstd -dcq",
+               coffset + 1, path, csize);
+    else
+      snprintf(cmd, sizeof(cmd), "zstd -dcq -- '%s'", path);
+    s->fp = popen(cmd, "r");
+    s->popened = 1;
+    if (s->fp == NULL) {
+      perror("zstd");
+      return -1;
+    }
+#endif
+  }
+  return 0;
+}
 
-  FILE *fp = fopen(fpname, "rb");
-  if (fp == NULL) {
-    perror(fpname);
-    return NULL; 
+static void ffstream_close(ffstream_t *s) {
+  if (s->gz != NULL)
+    gzclose(s->gz);
+#ifdef FFLATTEN_ENABLE_ZSTD
+  if (s->zd != NULL) {
+    ZSTD_freeDCtx(s->zd);
+    free(s->inbuf);
   }
+#endif
+  if (s->fp != NULL && s->popened)
+    pclose(s->fp);
+  else if (s->fp != NULL)
+    fclose(s->fp);
+}
 
-  char header[8];
-  fread(header, 1, 8, fp);
-  if (png_sig_cmp((png_bytep)header, 0, 8)) {
-    fprintf(stderr, "%s: not a png\n", fpname);
-    return NULL;
+// reads len bytes unless the stream ends first. returns the bytes read
+static size_t ffstream_read(ffstream_t *s, void *buf, size_t len) {
+  if (s->gz != NULL) {
+    int l = gzread(s->gz, buf, len);
+    return l < 0 ? 0 : (size_t)l;
+  }
+#ifdef FFLATTEN_ENABLE_ZSTD
+  if (s->zd != NULL) {
+    ZSTD_outBuffer out = {buf, len, 0};
+    while (out.pos < out.size) {
+      if (s->in.pos == s->in.size) {
+        s->in.size = fread(s->inbuf, 1, ZSTD_DStreamInSize(), s->fp);
+        s->in.pos = 0;
+        if (s->in.size == 0)
+          break;
+      }
+      size_t r = ZSTD_decompressStream(s->zd, &out, &s->in);
+      if (ZSTD_isError(r)) {
+        fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(r));
+        break;
+      }
+    }
+    return out.pos;
   }
+#endif
+  size_t got = 0;
+  while (got < len) {
+    size_t l = fread((uint8_t *)buf + got, 1, len - got, s->fp);
+    if (l == 0)
+      break;
+    got += l;
+  }
+  return got;
+}
 
-  fseek(fp, 0, SEEK_SET);
+static int ffstream_skip(ffstream_t *s, uint64_t len) {
+  if (s->fp != NULL && !s->popened
+#ifdef FFLATTEN_ENABLE_ZSTD
+      && s->zd == NULL
+#endif
+     )
+    return fseeko(s->fp, len, SEEK_CUR);
+
+  uint8_t sink[64 * 1024];
+  while (len) {
+    size_t l = len < sizeof(sink) ? len : sizeof(sink);
+    if (ffstream_read(s, sink, l) != l)
+      return -1;
+    len -= l;
+  }
+  return 0;
+}
 
-  png_structp pstruct =
-    png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (pstruct == NULL) {
-    return NULL;
+static uint64_t fftar_octal(const char *field, size_t len) {
+  uint64_t v = 0;
+  // base-256, used by GNU tar for members of 8GiB and above
+  if ((uint8_t)field[0] & 0x80) {
+    for (size_t i = 1; i < len; i++)
+      v = (v << 8) | (uint8_t)field[i];
+    return v;
   }
-  
-  png_infop pinfo = png_create_info_struct(pstruct);
+  for (size_t i = 0; i < len && field[i]; i++)
+    if (field[i] >= '0' && field[i] <= '7')
+      v = (v << 3) | (field[i] - '0');
+  return v;
+}
 
-  if (setjmp(png_jmpbuf(pstruct)))
-    abort();
+static const char *fftar_strip(const char *name) {
+  while (name[0] == '.' && name[1] == '/')
+    name += 2;
+  return name;
+}
 
-  png_init_io(pstruct, fp);
-  png_read_info(pstruct, pinfo);
+static fftar_t *fftar_get(const char *path) {
+  for (fftar_t *t = fftar_index; t != NULL; t = t->next)
+    if (!strcmp(t->path, path))
+      return t;
+  fftar_t *t = calloc(1, sizeof(*t));
+  assert(t != NULL);
+  t->path = strdup(path);
+  t->next = fftar_index;
+  fftar_index = t;
+  return t;
+}
 
-  uint32_t img_width = png_get_image_width(pstruct, pinfo);
-  uint32_t img_height = png_get_image_height(pstruct, pinfo);
-  uint32_t img_bit_depth = png_get_bit_depth(pstruct, pinfo);
-  uint32_t img_color_type = png_get_color_type(pstruct, pinfo);
+/* members are found by name through an open addressed table, cuts
+ * holding thousands of frames are indexed on every open
+ */
+static size_t *fftar_slot(fftar_t *t, const char *name) {
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  for (const char *c = name; *c; c++)
+    h = (h ^ (uint8_t)*c) * 1099511628211ULL;
+  size_t mask = t->alloc * 2 - 1, i = h & mask;
+  while (t->slots[i] && strcmp(t->members[t->slots[i] - 1].name, name))
+    i = (i + 1) & mask;
+  return &t->slots[i];
+}
 
-  if (img_color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_palette_to_rgb(pstruct);
+static ffmember_t *fftar_find(fftar_t *t, const char *name) {
+  if (t->nmembers == 0)
+    return NULL;
+  size_t *slot = fftar_slot(t, name);
+  return *slot ? &t->members[*slot - 1] : NULL;
+}
 
-  if (img_bit_depth == 16)
-    png_set_strip_16(pstruct);
+static void fftar_add(fftar_t *t, const char *name, uint64_t offset,
+                      uint64_t size, int64_t coffset, uint64_t csize) {
+  if (fftar_find(t, name) != NULL)
+    return;
+  if (t->nmembers == t->alloc) {
+    t->alloc = t->alloc ? t->alloc * 2 : 64;
+    t->members = realloc(t->members, sizeof(*t->members) * t->alloc);
+    free(t->slots);
+    t->slots = calloc(t->alloc * 2, sizeof(*t->slots));
+    assert(t->members != NULL && t->slots != NULL);
+    for (size_t i = 0; i < t->nmembers; i++)
+      *fftar_slot(t, t->members[i].name) = i + 1;
+  }
+  t->members[t->nmembers] =
+    (ffmember_t){strdup(name), offset, size, coffset, csize};
+  *fftar_slot(t, name) = ++t->nmembers;
+}
+
+/* loads the index newarchive.sh leaves at the end of a seekable archive:
+ * a zstd skippable frame of "<offset> <size> <name>" lines closed by a
+ * 24 byte "fftar-index <bytes of the frame>" line
+ */
+#define FFTAR_INDEX_MAGIC 0x184D2A5EU
+#define FFTAR_INDEX_TAIL 24
+
+static void fftar_load_index(fftar_t *t) {
+  char tail[FFTAR_INDEX_TAIL + 1] = {0};
+  unsigned long long total;
+  uint8_t hdr[8];
+
+  FILE *fp = fopen(t->path, "rb");
+  if (fp == NULL)
+    return;
+  if (fseeko(fp, -FFTAR_INDEX_TAIL, SEEK_END) ||
+      fread(tail, 1, FFTAR_INDEX_TAIL, fp) != FFTAR_INDEX_TAIL ||
+      sscanf(tail, "fftar-index %11llu\n", &total) != 1 ||
+      total < 8 + FFTAR_INDEX_TAIL || fseeko(fp, -(off_t)total, SEEK_END) ||
+      fread(hdr, 1, 8, fp) != 8)
+    goto out;
+  uint32_t magic = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (uint32_t)hdr[3] << 24;
+  uint32_t payload = hdr[4] | hdr[5] << 8 | hdr[6] << 16 | (uint32_t)hdr[7] << 24;
+  if (magic != FFTAR_INDEX_MAGIC || payload != total - 8)
+    goto out;
+
+  char *index = malloc(payload + 1);
+  assert(index != NULL);
+  if (fread(index, 1, payload, fp) != payload) {
+    free(index);
+    goto out;
+  }
+  index[payload - FFTAR_INDEX_TAIL] = 0;
+  for (char *line = index, *next; *line; line = next) {
+    char *end;
+    next = strchr(line, '\n');
+    if (next == NULL)
+      break;
+    *next++ = 0;
+    uint64_t coffset = strtoull(line, &end, 10);
+    uint64_t csize = strtoull(end, &end, 10);
+    if (*end++ != ' ')
+      break;
+    fftar_add(t, fftar_strip(end), 0, 0, coffset, csize);
+  }
+  free(index);
+out:
+  fclose(fp);
+}
+
+/* reads a member of a tar archive into memory. returns NULL if the
+ * archive can not be read or has no such member
+ */
+uint8_t *fftar_read(const char *path, const char *member, size_t *len) {
+  fftar_t *t;
+  ffstream_t s;
+  uint8_t hdr[FFTAR_BLOCK];
+  char *longname = NULL;
+  uint64_t pos = 0;
+  uint8_t *ret = NULL;
+
+  member = fftar_strip(member);
+  pthread_mutex_lock(&fftar_lock);
+  t = fftar_get(path);
+  if (!t->probed) {
+    t->probed = 1;
+    fftar_load_index(t);
+  }
+  // members may move as others are added, keep a copy
+  ffmember_t found, *m = fftar_find(t, member);
+  if (m != NULL) {
+    found = *m;
+    m = &found;
+  }
+  pthread_mutex_unlock(&fftar_lock);
+
+  int64_t coffset = m != NULL ? m->coffset : -1;
+  if (ffstream_open(&s, path, coffset, m != NULL ? m->csize : 0))
+    return NULL;
+
+  if (coffset >= 0) {
+    // the frame starts with the member's own header
+  } else if (m != NULL && (s.fp == NULL || s.popened
+#ifdef FFLATTEN_ENABLE_ZSTD
+                            || s.zd != NULL
+#endif
+                           )) {
+    if (ffstream_skip(&s, m->offset))
+      goto out;
+    pos = m->offset;
+  } else if (m != NULL) {
+    if (fseeko(s.fp, m->offset, SEEK_SET))
+      goto out;
+    pos = m->offset;
+  }
+
+  while (ffstream_read(&s, hdr, FFTAR_BLOCK) == FFTAR_BLOCK) {
+    pos += FFTAR_BLOCK;
+    if (hdr[0] == 0)
+      break;
+
+    char name[256 + 1] = {0};
+    uint64_t size = fftar_octal((char *)hdr + 124, 12);
+    uint64_t padded = (size + FFTAR_BLOCK - 1) & ~(uint64_t)(FFTAR_BLOCK - 1);
+    char type = hdr[156];
+
+    if (type == 'L' || type == 'x') {
+      // GNU long name or pax header, both describe the next member
+      char *data = malloc(padded + 1);
+      assert(data != NULL);
+      if (ffstream_read(&s, data, padded) != padded) {
+        free(data);
+        break;
+      }
+      pos += padded;
+      data[size] = 0;
+      free(longname);
+      longname = NULL;
+      if (type == 'L') {
+        longname = data;
+        continue;
+      }
+      for (char *rec = data; rec < data + size; ) {
+        char *end;
+        unsigned long rlen = strtoul(rec, &end, 10);
+        if (rlen == 0 || rec + rlen > data + size)
+          break;
+        if (!strncmp(end, " path=", 6)) {
+          longname = strndup(end + 6, rec + rlen - (end + 6) - 1);
+          break;
+        }
+        rec += rlen;
+      }
+      free(data);
+      continue;
+    }
+
+    if (longname != NULL) {
+      strncpy(name, longname, sizeof(name) - 1);
+      free(longname);
+      longname = NULL;
+    } else if (!memcmp(hdr + 257, "ustar", 5) && hdr[345]) {
+      snprintf(name, sizeof(name), "%.155s/%.100s", (char *)hdr + 345,
+               (char *)hdr);
+    } else {
+      memcpy(name, hdr, 100);
+    }
+
+    const char *sname = fftar_strip(name);
+    if ((type == '0' || type == 0) && coffset < 0) {
+      pthread_mutex_lock(&fftar_lock);
+      fftar_add(t, sname, pos - FFTAR_BLOCK, size, -1, 0);
+      pthread_mutex_unlock(&fftar_lock);
+    }
+
+    if ((type == '0' || type == 0) && !strcmp(sname, member)) {
+      ret = malloc(size ? size : 1);
+      assert(ret != NULL);
+      if (ffstream_read(&s, ret, size) != size) {
+        fprintf(stderr, "%s#%s: truncated\n", path, member);
+        free(ret);
+        ret = NULL;
+      }
+      *len = size;
+      goto out;
+    }
+    if (ffstream_skip(&s, padded))
+      break;
+    pos += padded;
+  }
+  fprintf(stderr, "%s#%s: no such member\n", path, member);
+
+out:
+  free(longname);
+  ffstream_close(&s);
+  return ret;
+}
+
+/* With FFLATTEN_CACHE=<dir> in the environment, every decoded layer is
+ * also written to <dir> as a QOI image, which decodes several times
+ * faster than the PNG it came from. An entry is named after a hash of the
+ * layer's path, size and mtime (those of the archive for members) and
+ * repeats that key after the QOI end marker, so a changed source never
+ * hits a stale entry.
+ */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HASH(p) ((p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) % 64)
+#define QOI_HEADER 14
+
+static const uint8_t qoi_end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static void qoi_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t qoi_rd32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* QOI encoder fed a row at a time, into a buffer large enough for the
+ * worst case
+ */
+typedef struct qoienc_t qoienc_t;
+struct qoienc_t {
+  uint8_t *buf;
+  size_t len;
+  uint8_t index[64][4], prev[4];
+  uint32_t run;
+};
+
+static void qoienc_begin(qoienc_t *e, uint32_t width, uint32_t height) {
+  memset(e, 0, sizeof(*e));
+  e->prev[3] = 255;
+  e->buf = malloc(QOI_HEADER + (size_t)width * height * 5 + sizeof(qoi_end));
+  assert(e->buf != NULL);
+  memcpy(e->buf, "qoif", 4);
+  qoi_be32(e->buf + 4, width);
+  qoi_be32(e->buf + 8, height);
+  e->buf[12] = 4;
+  e->buf[13] = 0;
+  e->len = QOI_HEADER;
+}
+
+static void qoienc_row(qoienc_t *e, const uint8_t *row, uint32_t width) {
+  uint8_t *buf = e->buf, *prev = e->prev;
+  size_t p = e->len;
+  for (uint32_t x = 0; x < width; x++) {
+    const uint8_t *px = row + x * 4;
+    if (!memcmp(px, prev, 4)) {
+      if (++e->run == 62) {
+        buf[p++] = QOI_OP_RUN | (e->run - 1);
+        e->run = 0;
+      }
+      continue;
+    }
+    if (e->run) {
+      buf[p++] = QOI_OP_RUN | (e->run - 1);
+      e->run = 0;
+    }
+
+    int h = QOI_HASH(px);
+    if (!memcmp(e->index[h], px, 4)) {
+      buf[p++] = QOI_OP_INDEX | h;
+    } else if (px[3] == prev[3]) {
+      int8_t dr = px[0] - prev[0];
+      int8_t dg = px[1] - prev[1];
+      int8_t db = px[2] - prev[2];
+      int8_t dr_dg = dr - dg;
+      int8_t db_dg = db - dg;
+      if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+        buf[p++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+      } else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 &&
+                 db_dg > -9 && db_dg < 8) {
+        buf[p++] = QOI_OP_LUMA | (dg + 32);
+        buf[p++] = (dr_dg + 8) << 4 | (db_dg + 8);
+      } else {
+        buf[p++] = QOI_OP_RGB;
+        memcpy(buf + p, px, 3);
+        p += 3;
+      }
+    } else {
+      buf[p++] = QOI_OP_RGBA;
+      memcpy(buf + p, px, 4);
+      p += 4;
+    }
+    memcpy(e->index[h], px, 4);
+    memcpy(prev, px, 4);
+  }
+  e->len = p;
+}
+
+static void qoienc_end(qoienc_t *e) {
+  if (e->run)
+    e->buf[e->len++] = QOI_OP_RUN | (e->run - 1);
+  e->run = 0;
+  memcpy(e->buf + e->len, qoi_end, sizeof(qoi_end));
+  e->len += sizeof(qoi_end);
+}
+
+/* every decoder hands its u8 rows to a sink, which converts them into the
+ * layer's f32 image as they come and, when caching, encodes them into its
+ * QOI entry. no full u8 copy of a layer is ever held
+ */
+typedef struct ffsink_t ffsink_t;
+struct ffsink_t {
+  imgf32_t *img;
+  float opacity;
+  qoienc_t *qoi;
+  float32_t x, y, scale;
+  uint32_t width, height; // of the decoded image, img is smaller in proxies
+  uint32_t *box; // sums of the proxy row being decoded
+};
+
+static void ffsink_begin(ffsink_t *s, uint32_t width, uint32_t height) {
+  s->width = width;
+  s->height = height;
+  s->img = alloc_imgf32((width + ffproxy - 1) / ffproxy,
+                        (height + ffproxy - 1) / ffproxy);
+  s->img->opaque = s->opacity == 1.0;
+  imgf32_place(s->img, s->x, s->y, s->scale);
+  if (ffproxy > 1) {
+    s->box = calloc((size_t)s->img->width * 4, sizeof(*s->box));
+    assert(s->box != NULL);
+  }
+  if (s->qoi != NULL)
+    qoienc_begin(s->qoi, width, height);
+}
+
+static void ffsink_row(ffsink_t *s, uint32_t y, const uint8_t *row) {
+  if (s->box == NULL) {
+    rowu8_f32(s->img->rows[y], row, s->width, s->opacity);
+  } else {
+    // ffproxy x ffproxy blocks, weighted by alpha
+    for (uint32_t x = 0; x < s->width; x++) {
+      const uint8_t *spx = row + x * 4;
+      uint32_t *b = s->box + x / ffproxy * 4;
+      b[0] += spx[0] * spx[3];
+      b[1] += spx[1] * spx[3];
+      b[2] += spx[2] * spx[3];
+      b[3] += spx[3];
+    }
+    if ((y + 1) % ffproxy == 0 || y + 1 == s->height) {
+      boxu32_f32(s->img->rows[y / ffproxy], s->box, s->img->width, s->width,
+                 y % ffproxy + 1, s->opacity);
+      memset(s->box, 0, sizeof(*s->box) * 4 * s->img->width);
+    }
+    if (y + 1 == s->height) {
+      free(s->box);
+      s->box = NULL;
+    }
+  }
+  if (s->img->opaque) {
+    uint8_t alpha = 255;
+    for (uint32_t x = 0; x < s->width; x++)
+      alpha &= row[x * 4 + 3];
+    s->img->opaque = alpha == 255;
+  }
+  if (s->qoi != NULL)
+    qoienc_row(s->qoi, row, s->width);
+}
+
+// drops what a decoder that gave up has put so far
+static void ffsink_abort(ffsink_t *s) {
+  if (s->img != NULL)
+    free_imgf32(s->img);
+  s->img = NULL;
+  free(s->box);
+  s->box = NULL;
+  if (s->qoi != NULL) {
+    free(s->qoi->buf);
+    s->qoi->buf = NULL;
+  }
+}
+
+/* decodes a QOI image of len bytes into sink. the bytes after its end
+ * marker are returned in tail. -1 if the image is corrupt
+ */
+static int qoi_decode(const uint8_t *buf, size_t len, ffsink_t *sink,
+                      const uint8_t **tail) {
+  uint8_t index[64][4] = {{0}};
+  uint8_t px[4] = {0, 0, 0, 255};
+
+  if (len < QOI_HEADER + sizeof(qoi_end) || memcmp(buf, "qoif", 4) ||
+      buf[12] != 4)
+    return -1;
+  uint32_t width = qoi_rd32(buf + 4);
+  uint32_t height = qoi_rd32(buf + 8);
+  if (width == 0 || height == 0 || (uint64_t)width * height > 1 << 28)
+    return -1;
+
+  uint8_t *row = malloc((size_t)width * 4);
+  assert(row != NULL);
+  ffsink_begin(sink, width, height);
+
+  size_t p = QOI_HEADER, end = len - sizeof(qoi_end);
+  uint32_t run = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      if (run) {
+        run--;
+      } else if (p < end) {
+        uint8_t b1 = buf[p++];
+        if (b1 == QOI_OP_RGB) {
+          memcpy(px, buf + p, 3);
+          p += 3;
+        } else if (b1 == QOI_OP_RGBA) {
+          memcpy(px, buf + p, 4);
+          p += 4;
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+          memcpy(px, index[b1], 4);
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+          px[0] += ((b1 >> 4) & 3) - 2;
+          px[1] += ((b1 >> 2) & 3) - 2;
+          px[2] += (b1 & 3) - 2;
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+          uint8_t b2 = buf[p++];
+          int vg = (b1 & 0x3f) - 32;
+          px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+          px[1] += vg;
+          px[2] += vg - 8 + (b2 & 0x0f);
+        } else {
+          run = b1 & 0x3f;
+        }
+        memcpy(index[QOI_HASH(px)], px, 4);
+      } else {
+        goto corrupt;
+      }
+      memcpy(row + x * 4, px, 4);
+    }
+    ffsink_row(sink, y, row);
+  }
+  if (p > end || memcmp(buf + p, qoi_end, sizeof(qoi_end)))
+    goto corrupt;
+  free(row);
+  *tail = buf + p + sizeof(qoi_end);
+  return 0;
+
+corrupt:
+  free(row);
+  ffsink_abort(sink);
+  return -1;
+}
+
+/* fills the key and the cache entry path of a layer, archive#member or
+ * plain file. returns 0 when there is no cache or the layer can't be stat
+ */
+static int ffcache_key(const char *fpname, char *key, size_t keylen,
+                       char *entry, size_t entrylen) {
+  const char *dir = getenv("FFLATTEN_CACHE");
+  struct stat st;
+  char src[PATH_MAX];
+
+  if (dir == NULL || !dir[0])
+    return 0;
+  strncpy(src, fpname, sizeof(src) - 1);
+  src[sizeof(src) - 1] = 0;
+  char *hash = strrchr(src, '#');
+  if (hash != NULL)
+    *hash = 0;
+  if (stat(src, &st))
+    return 0;
+
+  snprintf(key, keylen, "%s\n%lld\n%lld.%09ld\n", fpname,
+           (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+           st.st_mtim.tv_nsec);
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *c = key; *c; c++)
+    h = (h ^ (uint8_t)*c) * 0x100000001b3ULL;
+  snprintf(entry, entrylen, "%s/%016" PRIx64 ".qoi", dir, h);
+  return 1;
+}
+
+// 0 if a valid entry was decoded into sink
+static int ffcache_load(const char *key, const char *entry, ffsink_t *sink) {
+  struct stat st;
+  int fd = open(entry, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  uint8_t *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    return -1;
+  madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+  const uint8_t *tail;
+  size_t klen = strlen(key);
+  int ret = qoi_decode(buf, st.st_size, sink, &tail);
+  if (!ret && ((size_t)(buf + st.st_size - tail) != klen ||
+               memcmp(tail, key, klen))) {
+    ffsink_abort(sink);
+    ret = -1;
+  }
+  munmap(buf, st.st_size);
+  return ret;
+}
+
+// written aside and renamed, so concurrent runs never see half an entry
+static void ffcache_store(const char *key, const char *entry, qoienc_t *qoi) {
+  char tmp[PATH_MAX + 48];
+
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%lx", entry, (long)getpid(),
+           (unsigned long)pthread_self());
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    perror(tmp);
+    return;
+  }
+  int ok = fwrite(qoi->buf, 1, qoi->len, fp) == qoi->len &&
+           fwrite(key, 1, strlen(key), fp) == strlen(key);
+  if (fclose(fp) || !ok || rename(tmp, entry)) {
+    perror(tmp);
+    unlink(tmp);
+  }
+}
+
+/* Every layer we draw is 8-bit RGBA without interlacing, so those are
+ * decoded here without libpng's transform machinery: IDAT is inflated a
+ * row at a time and each row is unfiltered as soon as it is whole, a
+ * pixel (four bytes) at a time with GCC vector extensions. Anything else,
+ * or anything this path doesn't like, goes through libpng.
+ */
+typedef uint8_t ffpx8_t __attribute__((vector_size(4)));
+typedef int16_t ffpx16_t __attribute__((vector_size(8)));
+typedef uint8_t ffrow8_t __attribute__((vector_size(16)));
+
+static inline ffpx16_t ffpx_load(const uint8_t *p) {
+  ffpx8_t v;
+  memcpy(&v, p, 4);
+  return __builtin_convertvector(v, ffpx16_t);
+}
+
+static inline void ffpx_add(uint8_t *dst, const uint8_t *raw, ffpx16_t pred) {
+  ffpx8_t v;
+  memcpy(&v, raw, 4);
+  v += __builtin_convertvector(pred, ffpx8_t);
+  memcpy(dst, &v, 4);
+}
+
+/* undoes the filter of one row of width pixels, raw being the filtered
+ * bytes after the filter type. prev is the row above, all zeros on the
+ * first row
+ */
+static int ffpng_unfilter(uint8_t *out, const uint8_t *raw,
+                          const uint8_t *prev, int type, uint32_t width) {
+  size_t len = (size_t)width * 4, x = 0;
+  const ffpx16_t zero = {0};
+
+  switch (type) {
+  case 0: // None
+    memcpy(out, raw, len);
+    break;
+  case 1: // Sub
+    memcpy(out, raw, 4);
+    for (x = 4; x < len; x += 4)
+      ffpx_add(out + x, raw + x, ffpx_load(out + x - 4));
+    break;
+  case 2: // Up
+    for (; x + 16 <= len; x += 16) {
+      ffrow8_t r, u;
+      memcpy(&r, raw + x, 16);
+      memcpy(&u, prev + x, 16);
+      r += u;
+      memcpy(out + x, &r, 16);
+    }
+    for (; x < len; x++)
+      out[x] = raw[x] + prev[x];
+    break;
+  case 3: { // Average
+    ffpx16_t left = zero;
+    for (x = 0; x < len; x += 4) {
+      ffpx_add(out + x, raw + x, (left + ffpx_load(prev + x)) >> 1);
+      left = ffpx_load(out + x);
+    }
+    break;
+  }
+  case 4: { // Paeth
+    ffpx16_t a = zero, c = zero;
+    for (x = 0; x < len; x += 4) {
+      ffpx16_t b = ffpx_load(prev + x);
+      ffpx16_t pa = b - c, pb = a - c, pc = pa + pb;
+      pa = (pa ^ (pa >> 15)) - (pa >> 15);
+      pb = (pb ^ (pb >> 15)) - (pb >> 15);
+      pc = (pc ^ (pc >> 15)) - (pc >> 15);
+      ffpx16_t use_a = (pa <= pb) & (pa <= pc);
+      ffpx16_t use_b = ~use_a & (pb <= pc);
+      ffpx16_t use_c = ~use_a & ~use_b;
+      ffpx_add(out + x, raw + x, (a & use_a) | (b & use_b) | (c & use_c));
+      a = ffpx_load(out + x);
+      c = b;
+    }
+    break;
+  }
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+static uint32_t ffpng_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* decodes into sink, a row at a time. -1, with nothing left in sink, when
+ * the PNG is not 8-bit RGBA or not one this path can read
+ */
+static int ffpng_decode(const uint8_t *data, size_t len, ffsink_t *sink) {
+  uint32_t width = 0, height = 0, y = 0;
+  size_t p = 8;
+  int ok = 0;
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK)
+    return -1;
+
+  // line is the filtered row being inflated, fill bytes of it so far
+  uint8_t *line = NULL, *rows = NULL;
+  size_t stride = 0, fill = 0;
+
+  while (p + 12 <= len) {
+    uint32_t clen = ffpng_be32(data + p);
+    const uint8_t *type = data + p + 4, *cdata = data + p + 8;
+    if (clen > len - p - 12)
+      goto out;
+    if (crc32(crc32(0, NULL, 0), type, clen + 4) != ffpng_be32(cdata + clen))
+      goto out;
+    p += 12 + clen;
+
+    if (!memcmp(type, "IHDR", 4)) {
+      if (clen != 13 || line != NULL)
+        goto out;
+      width = ffpng_be32(cdata);
+      height = ffpng_be32(cdata + 4);
+      // depth 8, RGBA, deflate, adaptive filtering, no interlace
+      if (cdata[8] != 8 || cdata[9] != 6 || cdata[10] || cdata[11] ||
+          cdata[12] || width == 0 || height == 0 ||
+          (uint64_t)width * height > 1 << 28)
+        goto out;
+      stride = (size_t)width * 4 + 1;
+      line = malloc(stride);
+      assert(line != NULL);
+      // the row above and the row being unfiltered, the first one all zeros
+      rows = calloc(2, stride - 1);
+      assert(rows != NULL);
+      ffsink_begin(sink, width, height);
+    } else if (!memcmp(type, "IDAT", 4)) {
+      if (line == NULL)
+        goto out;
+      zs.next_in = (uint8_t *)cdata;
+      zs.avail_in = clen;
+      // past the last row there is no room left, only the adler32 to read.
+      // a row filled up may leave more output in zlib with no input left
+      int full;
+      do {
+        zs.next_out = line + fill;
+        zs.avail_out = y < height ? stride - fill : 0;
+        int r = inflate(&zs, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END && !(r == Z_BUF_ERROR && zs.avail_in == 0))
+          goto out;
+        full = y < height && zs.avail_out == 0;
+        fill = zs.next_out - line;
+        if (fill == stride) {
+          uint8_t *cur = rows + (y & 1) * (stride - 1);
+          uint8_t *prev = rows + !(y & 1) * (stride - 1);
+          if (ffpng_unfilter(cur, line + 1, prev, line[0], width))
+            goto out;
+          ffsink_row(sink, y++, cur);
+          fill = 0;
+        }
+        if (r == Z_STREAM_END)
+          break;
+      } while (zs.avail_in > 0 || full);
+    } else if (!memcmp(type, "IEND", 4)) {
+      break;
+    } else if (!(type[0] & 0x20)) {
+      // a critical chunk we don't know, libpng will tell
+      goto out;
+    }
+  }
+  ok = line != NULL && y == height;
+
+out:
+  if (!ok && line != NULL)
+    ffsink_abort(sink);
+  inflateEnd(&zs);
+  free(line);
+  free(rows);
+  return ok ? 0 : -1;
+}
+
+/* A layer is read whole into memory before libpng sees it: files are
+ * mmap()ed, archive members come from fftar_read() and "-" is stdin.
+ * libpng then pulls its bytes through ffinput_read() without a syscall.
+ */
+typedef struct ffinput_t ffinput_t;
+struct ffinput_t {
+  uint8_t *data;
+  size_t len, pos;
+  int mapped;
+};
+
+// reads all of fd, for pipes and whatever else can't be mapped
+static uint8_t *ffinput_slurp(int fd, size_t *len) {
+  size_t alloc = 1 << 20;
+  uint8_t *buf = malloc(alloc);
+  assert(buf != NULL);
+  *len = 0;
+  for (;;) {
+    if (*len == alloc) {
+      alloc *= 2;
+      buf = realloc(buf, alloc);
+      assert(buf != NULL);
+    }
+    ssize_t l = read(fd, buf + *len, alloc - *len);
+    if (l < 0 && errno == EINTR)
+      continue;
+    if (l < 0) {
+      free(buf);
+      return NULL;
+    }
+    if (l == 0)
+      return buf;
+    *len += l;
+  }
+}
+
+static int ffinput_open(ffinput_t *in, char *fpname) {
+  struct stat st;
+  memset(in, 0, sizeof(*in));
+
+  // archive.tar.zst#member.png
+  char *hash = strrchr(fpname, '#');
+  if (hash != NULL) {
+    *hash = 0;
+    in->data = fftar_read(fpname, hash + 1, &in->len);
+    *hash = '#';
+    return in->data == NULL ? -1 : 0;
+  }
+
+  int fd = strcmp(fpname, "-") ? open(fpname, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(fpname);
+    return -1;
+  }
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    in->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in->data != MAP_FAILED) {
+      in->len = st.st_size;
+      in->mapped = 1;
+      madvise(in->data, in->len, MADV_SEQUENTIAL);
+      madvise(in->data, in->len, MADV_WILLNEED);
+    } else {
+      in->data = NULL;
+    }
+  }
+  if (in->data == NULL)
+    in->data = ffinput_slurp(fd, &in->len);
+  if (in->data == NULL)
+    perror(fpname);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return in->data == NULL ? -1 : 0;
+}
+
+static void ffinput_close(ffinput_t *in) {
+  if (in->mapped)
+    munmap(in->data, in->len);
+  else
+    free(in->data);
+}
+
+static void ffinput_read(png_structp pstruct, png_bytep out, png_size_t len) {
+  ffinput_t *in = png_get_io_ptr(pstruct);
+  if (in->len - in->pos < len)
+    png_error(pstruct, "unexpected end of file");
+  memcpy(out, in->data + in->pos, len);
+  in->pos += len;
+}
+
+/* opens png file and stores its value to float32 */
+static imgf32_t *decode_pngf32(char *fstr) {
+  if (ffgen_is(fstr))
+    return ffgen_open(fstr);
+
+  float opacity = 1.0;
+  char fpname[PATH_MAX] = {0};
+  for (unsigned int cndx = 0; cndx < PATH_MAX - 1 && cndx < strlen(fstr); cndx++) {
+    if (fstr[cndx] == ':') {
+      strncpy(fpname, fstr, cndx);
+      opacity = atof(fstr + cndx + 1);
+      break;
+    }
+  }
+  if (!fpname[0]) {
+    strncpy(fpname, fstr, PATH_MAX - 1);
+  }
+
+  // file.png@x,y[,scale] places a layer smaller than the canvas
+  float32_t x = 0.0, y = 0.0, scale = 1.0;
+  char *at = strrchr(fpname, '@');
+  int end = 0, more = 0;
+  if (at != NULL && sscanf(at + 1, "%f,%f%n", &x, &y, &end) == 2 &&
+      (at[1 + end] == '\0' ||
+       (sscanf(at + 1 + end, ",%f%n", &scale, &more) == 1 &&
+        at[1 + end + more] == '\0' && scale > 0.0f)))
+    *at = '\0';
+  else
+    x = y = 0.0, scale = 1.0;
+
+  ffsink_t sink = {NULL, opacity, NULL, x, y, scale, 0, 0, NULL};
+  qoienc_t qoi;
+  char key[PATH_MAX + 64], entry[PATH_MAX];
+  int cache = ffcache_key(fpname, key, sizeof(key), entry, sizeof(entry));
+  if (cache) {
+    if (!ffcache_load(key, entry, &sink))
+      return sink.img;
+    sink.qoi = &qoi;
+  }
+
+  ffinput_t in;
+  if (ffinput_open(&in, fpname))
+    return NULL;
+
+  if (in.len < 8 || png_sig_cmp(in.data, 0, 8)) {
+    fprintf(stderr, "%s: not a png\n", fpname);
+    ffinput_close(&in);
+    return NULL;
+  }
+
+  if (!ffpng_decode(in.data, in.len, &sink))
+    goto done;
+
+  png_structp pstruct =
+    png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (pstruct == NULL) {
+    ffinput_close(&in);
+    return NULL;
+  }
+  
+  png_infop pinfo = png_create_info_struct(pstruct);
+
+  if (setjmp(png_jmpbuf(pstruct)))
+    abort();
+
+  png_set_read_fn(pstruct, &in, ffinput_read);
+  png_read_info(pstruct, pinfo);
+
+  uint32_t img_width = png_get_image_width(pstruct, pinfo);
+  uint32_t img_height = png_get_image_height(pstruct, pinfo);
+  uint32_t img_bit_depth = png_get_bit_depth(pstruct, pinfo);
+  uint32_t img_color_type = png_get_color_type(pstruct, pinfo);
+
+  if (img_color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(pstruct);
+
+  if (img_bit_depth == 16)
+    png_set_strip_16(pstruct);
 
   if (img_color_type == PNG_COLOR_TYPE_GRAY && img_bit_depth < 8)
     png_set_expand_gray_1_2_4_to_8(pstruct);
@@ -1003,29 +3017,38 @@ imgf32_t *open_pngf32(char *fstr) {
       img_color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
     png_set_gray_to_rgb(pstruct);
 
+  int passes = png_set_interlace_handling(pstruct);
   png_read_update_info(pstruct, pinfo);
-
-  uint8_t **img_rows = malloc(sizeof(*img_rows)*img_height);
-  assert(img_rows != NULL);
-
-  for (uint32_t y = 0; y < img_height; y++) {
-    img_rows[y] = malloc(sizeof(**img_rows)*img_width*4);
-    assert(img_rows[y] != NULL);
+  assert(png_get_rowbytes(pstruct, pinfo) == (size_t)img_width * 4);
+
+  ffsink_begin(&sink, img_width, img_height);
+  if (passes == 1) {
+    // converted as libpng hands out each row
+    uint8_t *row = malloc((size_t)img_width * 4);
+    assert(row != NULL);
+    for (uint32_t y = 0; y < img_height; y++) {
+      png_read_row(pstruct, row, NULL);
+      ffsink_row(&sink, y, row);
+    }
+    free(row);
+  } else {
+    // interlaced rows are only complete after the last pass
+    uint8_t *pixels = malloc((size_t)img_width * 4 * img_height);
+    png_bytep *rows = malloc(sizeof(*rows) * img_height);
+    assert(pixels != NULL && rows != NULL);
+    for (uint32_t y = 0; y < img_height; y++)
+      rows[y] = pixels + (size_t)y * img_width * 4;
+    png_read_image(pstruct, rows);
+    for (uint32_t y = 0; y < img_height; y++)
+      ffsink_row(&sink, y, rows[y]);
+    free(rows);
+    free(pixels);
   }
 
-  png_read_image(pstruct, img_rows);
-
-  imgf32_t *imgf32 = imgu8_f32(&(imgu8_t){
-    img_width,
-    img_height,
-    img_rows
-  });
-  imgf32->opacity = opacity;
-
 
 #ifdef FFDEBUG
   for (int x = 0; x < 10; x++) {
-    float32_t *fpx = imgf32->rows[0] + x*4;
+    float32_t *fpx = sink.img->rows[0] + x*4;
     //float32x4_t thsl = rgb2hsl((float32x4_t){fpx[0], fpx[1], fpx[2]});
     fprintf(stderr, "t r %f g %f b %f\n", fpx[0], fpx[1], fpx[2]);
 //    fprintf(stderr, "t h %f s %f l %f\n",
@@ -1041,13 +3064,885 @@ imgf32_t *open_pngf32(char *fstr) {
 #endif /* FFDEBUG */
 
   png_destroy_read_struct(&pstruct, &pinfo, NULL);
-  fclose(fp);
-  return imgf32;  
+
+done:
+  if (sink.qoi != NULL) {
+    qoienc_end(&qoi);
+    ffcache_store(key, entry, &qoi);
+    free(qoi.buf);
+  }
+  ffinput_close(&in);
+  return sink.img;
 }
 
-int main(int argc, char *argv[]) {
-  (void)rgb2hsl((float32x4_t){2.0});
+/* Effects run on a layer as it is decoded, before it is blended, each
+ * appended to it after a |, as in top.png@40,20:0.8|shadow:6,6,4|glow:8:2
+ *   blur:r                        a gaussian blur, r its deviation in pixels
+ *   glow:r:strength               the layer over a blur of itself, its
+ *                                 alpha times strength
+ *   shadow:dx,dy,r[:#rrggbb[aa]]  the layer over its silhouette moved by
+ *                                 dx,dy and blurred, black by default
+ * A placed layer grows by the reach of its effects, so they are not cut
+ * at its edges, other layers keep the size of the canvas.
+ *
+ * The blur is three box blurs in a row, close to a gaussian, each a
+ * running sum so that a pixel costs as much whatever r. The rows are
+ * blurred, then the image is transposed for its columns to be blurred
+ * as rows, and transposed back.
+ */
+#define FFEFFECT_TILE 16
+
+// radii of the boxes, growing, see Kovesi, "Fast almost-Gaussian filtering"
+static void ffblur_boxes(float32_t sigma, uint32_t r[3]) {
+  int32_t wl = floorf(sqrtf(4.0f * sigma * sigma + 1.0f));
+  if (wl % 2 == 0)
+    wl--;
+  int32_t m = roundf((12.0f * sigma * sigma - 3 * wl * wl - 12 * wl - 9) /
+                     (-4.0f * wl - 4.0f));
+  for (int i = 0; i < 3; i++)
+    r[i] = ((i < m ? wl : wl + 2) - 1) / 2;
+}
+
+// a box of radius r over the n pixels of src, past the edges extended
+static void ffblur_box(float32_t *restrict dst, float32_t *restrict src,
+                       uint32_t n, uint32_t r) {
+  float32x4_t sum = vmulq_n_f32(vld1q_f32(src), r + 1);
+  for (uint32_t i = 1; i <= r; i++)
+    sum = vaddq_f32(sum, vld1q_f32(src + (i < n ? i : n - 1) * 4));
+  float32_t norm = 1.0f / (2 * r + 1);
+  for (uint32_t i = 0; i < n; i++) {
+    vst1q_f32(dst + i * 4, vmulq_n_f32(sum, norm));
+    uint32_t in = i + r + 1 < n ? i + r + 1 : n - 1;
+    uint32_t out = i >= r ? i - r : 0;
+    sum = vaddq_f32(sum, vsubq_f32(vld1q_f32(src + in * 4),
+                                   vld1q_f32(src + out * 4)));
+  }
+}
+
+// the three boxes over every row, tmp a row as wide
+static void ffblur_rows(float32_t **rows, uint32_t width, uint32_t height,
+                        const uint32_t r[3], float32_t *tmp) {
+  for (uint32_t y = 0; y < height; y++) {
+    ffblur_box(tmp, rows[y], width, r[0]);
+    ffblur_box(rows[y], tmp, width, r[1]);
+    ffblur_box(tmp, rows[y], width, r[2]);
+    memcpy(rows[y], tmp, sizeof(*tmp) * 4 * width);
+  }
+}
+
+// dst the height x width transpose of src, a tile at a time
+static void fftranspose(float32_t **dst, float32_t **src, uint32_t width,
+                        uint32_t height) {
+  for (uint32_t ty = 0; ty < height; ty += FFEFFECT_TILE)
+    for (uint32_t tx = 0; tx < width; tx += FFEFFECT_TILE)
+      for (uint32_t y = ty; y < height && y < ty + FFEFFECT_TILE; y++)
+        for (uint32_t x = tx; x < width && x < tx + FFEFFECT_TILE; x++)
+          vst1q_f32(dst[x] + y * 4, vld1q_f32(src[y] + x * 4));
+}
+
+// img premultiplied
+static void ffblur(imgf32_t *img, const uint32_t r[3]) {
+  if (r[2] == 0)
+    return;
+  uint32_t len = img->width > img->height ? img->width : img->height;
+  float32_t *tmp = malloc(sizeof(*tmp) * 4 * len);
+  assert(tmp != NULL);
+  imgf32_t *t = alloc_imgf32(img->height, img->width);
+  ffblur_rows(img->rows, img->width, img->height, r, tmp);
+  fftranspose(t->rows, img->rows, img->width, img->height);
+  ffblur_rows(t->rows, img->height, img->width, r, tmp);
+  fftranspose(img->rows, t->rows, img->height, img->width);
+  free_imgf32(t);
+  free(tmp);
+}
+
+static void ffpremul(imgf32_t *img) {
+  for (uint32_t y = 0; y < img->height; y++)
+    for (uint32_t x = 0; x < img->width; x++) {
+      float32_t *px = img->rows[y] + x * 4;
+      float32_t a = px[3];
+      vst1q_f32(px, vmulq_n_f32(vld1q_f32(px), a));
+      px[3] = a;
+    }
+}
+
+// img with pad transparent pixels more on every side, placed to match
+static imgf32_t *ffeffect_pad(imgf32_t *img, uint32_t pad) {
+  imgf32_t *ret = alloc_imgf32(img->width + 2 * pad, img->height + 2 * pad);
+  for (uint32_t y = 0; y < ret->height; y++) {
+    memset(ret->rows[y], 0, sizeof(**ret->rows) * 4 * ret->width);
+    if (y >= pad && y - pad < img->height)
+      memcpy(ret->rows[y] + pad * 4, img->rows[y - pad],
+             sizeof(**ret->rows) * 4 * img->width);
+  }
+  ret->opacity = img->opacity;
+  ret->x = img->x - (int32_t)pad;
+  ret->y = img->y - (int32_t)pad;
+  ret->fx = img->fx - pad * img->scale;
+  ret->fy = img->fy - pad * img->scale;
+  ret->scale = img->scale;
+  ret->pad = img->pad + pad;
+  free_imgf32(img);
+  return ret;
+}
+
+/* applies one effect to *img, padded first when placed. -1 if spec is
+ * none. img is straight alpha, the effects work premultiplied
+ */
+static int ffeffect_apply(imgf32_t **img, const char *spec, int placed) {
+  float32_t r, strength = 1.0f, dx = 0.0f, dy = 0.0f;
+  float32x4_t color = {0.0, 0.0, 0.0, 1.0};
+  char kind = spec[0];
+  int end = 0;
+  if (!(kind == 'b' && sscanf(spec, "blur:%f%n", &r, &end) == 1 &&
+        spec[end] == '\0') &&
+      !(kind == 'g' && sscanf(spec, "glow:%f:%f%n", &r, &strength, &end) == 2 &&
+        spec[end] == '\0') &&
+      !(kind == 's' && sscanf(spec, "shadow:%f,%f,%f%n", &dx, &dy, &r, &end) == 3 &&
+        (spec[end] == '\0' ||
+         (spec[end] == ':' && !ffgen_color(spec + end + 1, &color)))))
+    return -1;
+  if (r < 0.0f || strength < 0.0f)
+    return -1;
+
+  uint32_t radii[3];
+  ffblur_boxes(r / ffproxy, radii);
+  int32_t sx = roundf(dx / ffproxy), sy = roundf(dy / ffproxy);
+  uint32_t reach = radii[0] + radii[1] + radii[2];
+  reach += (uint32_t)(abs(sx) > abs(sy) ? abs(sx) : abs(sy));
+  if (placed && reach > 0)
+    *img = ffeffect_pad(*img, reach);
+
+  imgf32_t *layer = *img;
+  if (layer->opaque) {
+    // nothing shows under it, and a blur keeps it opaque
+    if (kind != 'b')
+      return 0;
+    ffblur(layer, radii);
+    for (uint32_t y = 0; y < layer->height; y++)
+      for (uint32_t x = 0; x < layer->width; x++)
+        layer->rows[y][x * 4 + 3] = 1.0f;
+    return 0;
+  }
+
+  ffpremul(layer);
+  if (kind == 'b') {
+    ffblur(layer, radii);
+  } else {
+    // the glow or the shadow, then the layer over it
+    imgf32_t *under = alloc_imgf32(layer->width, layer->height);
+    for (uint32_t y = 0; y < layer->height; y++)
+      for (uint32_t x = 0; x < layer->width; x++) {
+        float32_t *upx = under->rows[y] + x * 4;
+        if (kind == 'g') {
+          vst1q_f32(upx, vld1q_f32(layer->rows[y] + x * 4));
+          continue;
+        }
+        int64_t lx = (int64_t)x - sx, ly = (int64_t)y - sy;
+        float32_t a = lx < 0 || ly < 0 || lx >= layer->width ||
+                      ly >= layer->height ? 0.0f :
+                      layer->rows[ly][lx * 4 + 3] * vgetq_lane_f32(color, 3);
+        vst1q_f32(upx, vmulq_n_f32(color, a));
+        upx[3] = a;
+      }
+    ffblur(under, radii);
+    for (uint32_t y = 0; y < layer->height; y++)
+      for (uint32_t x = 0; x < layer->width; x++) {
+        float32_t *lpx = layer->rows[y] + x * 4;
+        float32x4_t u = vld1q_f32(under->rows[y] + x * 4);
+        if (kind == 'g') {
+          float32_t k = strength * vgetq_lane_f32(u, 3) > 1.0f ?
+                        1.0f / vgetq_lane_f32(u, 3) : strength;
+          u = vmulq_n_f32(u, k);
+        }
+        vst1q_f32(lpx, vaddq_f32(vld1q_f32(lpx), vmulq_n_f32(u, 1.0f - lpx[3])));
+      }
+    free_imgf32(under);
+  }
+  for (uint32_t y = 0; y < layer->height; y++)
+    for (uint32_t x = 0; x < layer->width; x++)
+      ffunpremul(layer->rows[y] + x * 4);
+  return 0;
+}
+
+imgf32_t *open_pngf32(char *fstr) {
+  char *bar = strchr(fstr, '|');
+  if (bar == NULL)
+    return decode_pngf32(fstr);
+  if (ffgen_is(fstr)) {
+    fprintf(stderr, "%s: a generated layer can not take effects\n", fstr);
+    return NULL;
+  }
+
+  // the opacity fades the layer with its effects, it comes last
+  char spec[PATH_MAX];
+  float opacity = 1.0;
+  snprintf(spec, sizeof(spec), "%.*s", (int)(bar - fstr), fstr);
+  char *colon = strchr(spec, ':');
+  if (colon != NULL) {
+    *colon = '\0';
+    opacity = atof(colon + 1);
+  }
+  // placed as decode_pngf32 sees it
+  float32_t px, py;
+  char *at = strrchr(spec, '@');
+  int placed = at != NULL && sscanf(at + 1, "%f,%f", &px, &py) == 2;
+  imgf32_t *img = decode_pngf32(spec);
+  if (img == NULL)
+    return NULL;
+
+  for (char *effect = bar + 1; ; effect++) {
+    size_t len = strcspn(effect, "|");
+    char one[64];
+    snprintf(one, sizeof(one), "%.*s", (int)len, effect);
+    if (ffeffect_apply(&img, one, placed)) {
+      fprintf(stderr, "%s: %s is no effect, see usage\n", fstr, one);
+      free_imgf32(img);
+      return NULL;
+    }
+    effect += len;
+    if (*effect == '\0')
+      break;
+  }
+  if (opacity != 1.0) {
+    for (uint32_t y = 0; y < img->height; y++)
+      for (uint32_t x = 0; x < img->width; x++)
+        img->rows[y][x * 4 + 3] *= opacity;
+    img->opaque = 0;
+  }
+  return img;
+}
+
+/* Every layer of the op chain is decoded on a pool of FFLATTEN_JOBS
+ * threads (one per core by default), while main() blends them in order as
+ * they become ready. Workers stay at most two layers per thread ahead of
+ * the blending, so memory does not grow with the length of the chain.
+ */
+typedef struct ffdecode_t ffdecode_t;
+struct ffdecode_t {
+  char **layers;
+  imgf32_t **imgs;
+  uint8_t *done;
+  int nlayers, next, taken, window, stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t *threads;
+  int nthreads;
+};
+
+static void *ffdecode_worker(void *arg) {
+  ffdecode_t *d = arg;
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    while (!d->stop && d->next < d->nlayers &&
+           d->next >= d->taken + d->window)
+      pthread_cond_wait(&d->cond, &d->lock);
+    if (d->stop || d->next >= d->nlayers)
+      break;
+    int i = d->next++;
+    pthread_mutex_unlock(&d->lock);
+    imgf32_t *img = d->layers[i] != NULL ? open_pngf32(d->layers[i]) : NULL;
+    pthread_mutex_lock(&d->lock);
+    d->imgs[i] = img;
+    d->done[i] = 1;
+    pthread_cond_broadcast(&d->cond);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+static void ffdecode_start(ffdecode_t *d, char **layers, int nlayers) {
+  const char *jobs = getenv("FFLATTEN_JOBS");
+  memset(d, 0, sizeof(*d));
+  d->layers = layers;
+  d->nlayers = nlayers;
+  d->imgs = calloc(nlayers, sizeof(*d->imgs));
+  d->done = calloc(nlayers, sizeof(*d->done));
+  assert(d->imgs != NULL && d->done != NULL);
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->cond, NULL);
+
+  d->nthreads = jobs != NULL ? atoi(jobs) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (d->nthreads < 1)
+    d->nthreads = 1;
+  if (d->nthreads > nlayers)
+    d->nthreads = nlayers;
+  d->window = d->nthreads * 2;
+  d->threads = malloc(sizeof(*d->threads) * d->nthreads);
+  assert(d->threads != NULL);
+  for (int i = 0; i < d->nthreads; i++)
+    if (pthread_create(&d->threads[i], NULL, ffdecode_worker, d))
+      abort();
+}
+
+// waits for layer i. the caller owns the image, which may be NULL
+static imgf32_t *ffdecode_get(ffdecode_t *d, int i) {
+  pthread_mutex_lock(&d->lock);
+  while (!d->done[i])
+    pthread_cond_wait(&d->cond, &d->lock);
+  imgf32_t *img = d->imgs[i];
+  d->imgs[i] = NULL;
+  d->taken = i + 1;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  return img;
+}
+
+static void ffdecode_stop(ffdecode_t *d) {
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  for (int i = 0; i < d->nthreads; i++)
+    pthread_join(d->threads[i], NULL);
+  for (int i = 0; i < d->nlayers; i++)
+    if (d->imgs[i] != NULL)
+      free_imgf32(d->imgs[i]);
+  free(d->imgs);
+  free(d->done);
+  free(d->threads);
+  pthread_cond_destroy(&d->cond);
+  pthread_mutex_destroy(&d->lock);
+}
+
+// a single blend of top over base, -1 for an invalid op
+static int blend_one(char op, imgf32_t *base_img, imgf32_t *top_img) {
+  switch (op) {
+  DEFINE_BLEND_CASE(BASE       ,base_img, top_img);
+  DEFINE_BLEND_CASE(TOP        ,base_img, top_img);
+  DEFINE_BLEND_CASE(NORMAL     ,base_img, top_img);
+  DEFINE_BLEND_CASE(ADDITION   ,base_img, top_img);
+  DEFINE_BLEND_CASE(COLOR      ,base_img, top_img);
+  DEFINE_BLEND_CASE(COLOR_DODGE,base_img, top_img);
+  DEFINE_BLEND_CASE(DIFFERENCE ,base_img, top_img);
+  DEFINE_BLEND_CASE(DARKEN     ,base_img, top_img);
+  DEFINE_BLEND_CASE(DIVIDE     ,base_img, top_img);
+  DEFINE_BLEND_CASE(GAMMA_LIGHT,base_img, top_img);
+  DEFINE_BLEND_CASE(GAMMA_DARK ,base_img, top_img);
+  DEFINE_BLEND_CASE(HUE        ,base_img, top_img);
+  DEFINE_BLEND_CASE(LIGHTEN    ,base_img, top_img);
+  DEFINE_BLEND_CASE(LUMINOSITY ,base_img, top_img);
+  DEFINE_BLEND_CASE(MULTIPLY   ,base_img, top_img);
+  DEFINE_BLEND_CASE(OVERLAY    ,base_img, top_img);
+  DEFINE_BLEND_CASE(SATURATION ,base_img, top_img);
+  DEFINE_BLEND_CASE(SCREEN     ,base_img, top_img);
+  DEFINE_BLEND_CASE(SOFT_LIGHT ,base_img, top_img);
+  DEFINE_BLEND_CASE(HARD_LIGHT ,base_img, top_img);
+  default:
+    fprintf(stderr, "invalid op '%c'\n", op);
+    return -1;
+  }
+  return 0;
+}
+
+/* a layer of a range, kept decoded for as long as the frames use the
+ * same file, and the opacity and placement of the current frame
+ */
+typedef struct fflayer_t fflayer_t;
+struct fflayer_t {
+  char *name;
+  imgf32_t *img;
+  float opacity;
+  float32_t x, y, scale;
+};
+
+// layer i, decoded or held. with keep, the image stays with keep[i]
+static imgf32_t *flatten_layer(ffdecode_t *d, fflayer_t *keep, int i) {
+  imgf32_t *img = ffdecode_get(d, i);
+  if (keep == NULL)
+    return img;
+  if (img != NULL)
+    keep[i].img = img;
+  img = keep[i].img;
+  if (img != NULL) {
+    img->opacity = keep[i].opacity;
+    imgf32_place(img, keep[i].x, keep[i].y, keep[i].scale);
+  }
+  return img;
+}
+
+/* flattens one frame, chain being the n arguments
+ * base.png[:opacity] (<operator> top.png[@x,y][:opacity])*
+ * returns the composite or NULL. with keep, one per layer, the layers
+ * are bare file names and keep holds on to them, see flatten_range
+ */
+static imgf32_t *flatten_chain(char **chain, int n, fflayer_t *keep) {
+  // base.png and every top.png, chain[0], chain[2], ...
+  int nlayers = n / 2 + 1;
+  char **layers = malloc(sizeof(*layers) * nlayers);
+  assert(layers != NULL);
+  for (int i = 0; i < nlayers; i++)
+    layers[i] = keep != NULL && keep[i].img != NULL ? NULL : chain[i * 2];
+  ffdecode_t dec;
+  ffdecode_start(&dec, layers, nlayers);
+
+  imgf32_t *base_img = flatten_layer(&dec, keep, 0);
+  imgf32_t *tops[FFFUSE_MAX] = {NULL};
+  char ops[FFFUSE_MAX];
+  int ntops = 0, ok = 0;
+  if (base_img == NULL)
+      goto clean;
+  if (base_img->gen != NULL) {
+    fprintf(stderr, "%s: the base is the canvas, it can not be generated\n", chain[0]);
+    goto clean;
+  }
+  if (base_img->x != 0 || base_img->y != 0 || base_img->scale != 0.0) {
+    fprintf(stderr, "%s: the base is the canvas, it can not be placed\n", chain[0]);
+    goto clean;
+  }
+  // the held base stays as decoded, the frame blends over a copy
+  if (keep != NULL)
+    base_img = dup_imgf32(base_img);
+
+  for (int cur = 1; cur < n; ) {
+    // up to FFFUSE_MAX tops in a row that allow it are blended together.
+    // the first that does not ends the group, and is blended on its own
+    int first = cur, nfuse = 0;
+    for (ntops = 0; ntops < FFFUSE_MAX && cur < n; ntops++) {
+      ops[ntops] = chain[cur++][0];
+      tops[ntops] = flatten_layer(&dec, keep, cur++ / 2);
+      if (tops[ntops] == NULL)
+        goto clean;
+      if (base_img->opacity != 1.0 || tops[ntops]->opacity != 1.0 ||
+          (tops[ntops]->gen == NULL &&
+           (tops[ntops]->width != base_img->width ||
+            tops[ntops]->height != base_img->height)) ||
+          tops[ntops]->x != 0 || tops[ntops]->y != 0 ||
+          tops[ntops]->scale != 0.0 || blend_opaque(ops[ntops], 0, 0) < 0) {
+        ntops++;
+        break;
+      }
+      nfuse++;
+    }
+
+    if (nfuse > 1) {
+      blend_fused(base_img, tops, ops, nfuse);
+      for (int i = 0; i < nfuse; i++)
+        if (tops[i]->gen == NULL || !ffgen_adjusts(tops[i]->gen))
+          base_img->opaque = blend_opaque(ops[i], base_img->opaque,
+                                          tops[i]->opaque);
+    } else {
+      nfuse = 0;
+    }
+
+    for (int i = 0; i < ntops; i++) {
+      if (i >= nfuse && blend_one(ops[i], base_img, tops[i]))
+        goto clean;
+      fprintf(stderr, "'%c' -> %s\n", ops[i], chain[first + i * 2 + 1]);
+      if (keep == NULL)
+        free_imgf32(tops[i]);
+      tops[i] = NULL;
+    }
+    ntops = 0;
+  }
+  ok = 1;
+
+clean:
+  ffdecode_stop(&dec);
+  free(layers);
+  for (int i = 0; i < FFFUSE_MAX && keep == NULL; i++)
+    if (tops[i] != NULL)
+      free_imgf32(tops[i]);
+  if (!ok && base_img != NULL && (keep == NULL || base_img != keep[0].img)) {
+    free_imgf32(base_img);
+    base_img = NULL;
+  }
+  return base_img;
+}
+
+/* Batch mode flattens one frame per line of a list, the output path and
+ * then the arguments of a single frame, all separated by tabs:
+ *   flattened/0012.png<TAB>bg.png<TAB> <TAB>character.png:0.8
+ * Composites go to a queue of FFLATTEN_JOBS encoder threads while the
+ * next frame is being flattened. The queue holds as many frames as there
+ * are encoders, past that flattening waits for them.
+ */
+typedef struct ffencode_t ffencode_t;
+struct ffencode_t {
+  imgf32_t **imgs;
+  char **paths;
+  int size, head, count, stop, failed;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty, nonfull;
+  pthread_t *threads;
+  int nthreads;
+};
+
+// written aside and renamed, so a frame never appears half written
+static int ffencode_write(imgf32_t *img, const char *path) {
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.part", path);
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    perror(tmp);
+    return -1;
+  }
+  write_pngf32(img, fp);
+  if (rename(tmp, path)) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
 
+static void *ffencode_worker(void *arg) {
+  ffencode_t *q = arg;
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (!q->stop && q->count == 0)
+      pthread_cond_wait(&q->nonempty, &q->lock);
+    if (q->count == 0)
+      break;
+    imgf32_t *img = q->imgs[q->head];
+    char *path = q->paths[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&q->nonfull);
+    pthread_mutex_unlock(&q->lock);
+
+    int err = ffencode_write(img, path);
+    free_imgf32(img);
+    free(path);
+
+    pthread_mutex_lock(&q->lock);
+    q->failed |= err;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+static void ffencode_start(ffencode_t *q) {
+  const char *jobs = getenv("FFLATTEN_JOBS");
+  memset(q, 0, sizeof(*q));
+  q->nthreads = jobs != NULL ? atoi(jobs) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (q->nthreads < 1)
+    q->nthreads = 1;
+  q->size = q->nthreads;
+  q->imgs = malloc(sizeof(*q->imgs) * q->size);
+  q->paths = malloc(sizeof(*q->paths) * q->size);
+  q->threads = malloc(sizeof(*q->threads) * q->nthreads);
+  assert(q->imgs != NULL && q->paths != NULL && q->threads != NULL);
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->nonempty, NULL);
+  pthread_cond_init(&q->nonfull, NULL);
+  for (int i = 0; i < q->nthreads; i++)
+    if (pthread_create(&q->threads[i], NULL, ffencode_worker, q))
+      abort();
+}
+
+// hands img over to the encoders, waiting while the queue is full
+static void ffencode_push(ffencode_t *q, imgf32_t *img, const char *path) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->size)
+    pthread_cond_wait(&q->nonfull, &q->lock);
+  int tail = (q->head + q->count) % q->size;
+  q->imgs[tail] = img;
+  q->paths[tail] = strdup(path);
+  q->count++;
+  pthread_cond_signal(&q->nonempty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// drains the queue. returns -1 if any frame could not be written
+static int ffencode_finish(ffencode_t *q) {
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_broadcast(&q->nonempty);
+  pthread_mutex_unlock(&q->lock);
+  for (int i = 0; i < q->nthreads; i++)
+    pthread_join(q->threads[i], NULL);
+  free(q->imgs);
+  free(q->paths);
+  free(q->threads);
+  pthread_cond_destroy(&q->nonempty);
+  pthread_cond_destroy(&q->nonfull);
+  pthread_mutex_destroy(&q->lock);
+  return q->failed;
+}
+
+/* A line of a batch may also flatten a range of frames, from first to
+ * last, when it starts with first-last and a printf pattern for the
+ * outputs:
+ *   12-36<TAB>flattened/%04d.png<TAB>bg.png<TAB> <TAB>held.png:ease(12=0/36=1)
+ * %d in any layer is the frame number too. A layer naming the same file
+ * as in the frame before is not decoded again, only its opacity and
+ * placement are those of the new frame, and those may be animated, see
+ * fftrack_eval.
+ * first-last@x,y moves a camera to x,y over the range, which moves every
+ * placed layer file.png@x,y,scale,parallax by -parallax times x,y: 0 for
+ * a layer stuck to the screen, 1 (the default) for the main plane and
+ * less for the distant ones.
+ */
+
+/* an animated parameter: a number, or keyframes lin(frame=value/...) or
+ * ease(...), eased in and out of every key. before the first key and
+ * past the last the value holds
+ */
+static int fftrack_eval(const char *str, int frame, float *value) {
+  int ease = !strncmp(str, "ease(", 5);
+  if (!ease && strncmp(str, "lin(", 4)) {
+    char *end;
+    *value = strtof(str, &end);
+    return end == str || *end ? -1 : 0;
+  }
+
+  const char *p = str + (ease ? 5 : 4);
+  int f0 = 0;
+  float v0 = 0.0;
+  for (int k = 0; ; k++) {
+    int f, used = 0;
+    float v;
+    if (sscanf(p, "%d=%f%n", &f, &v, &used) != 2 || (k > 0 && f <= f0))
+      return -1;
+    p += used;
+    if (k == 0 || frame >= f) {
+      *value = v;
+    } else if (frame > f0) {
+      float u = (float)(frame - f0) / (f - f0);
+      if (ease)
+        u = u * u * (3.0f - 2.0f * u);
+      *value = v0 + (v - v0) * u;
+    }
+    f0 = f;
+    v0 = v;
+    if (*p == ')' && !p[1])
+      return 0;
+    if (*p++ != '/')
+      return -1;
+  }
+}
+
+// pattern with every %d (or %04d...) as frame, %% as %
+static int ffrange_expand(const char *pattern, int frame, char *out,
+                          size_t len) {
+  size_t o = 0;
+  for (const char *p = pattern; *p; p++) {
+    char conv[16];
+    int used = 0;
+    if (*p != '%') {
+      used = snprintf(out + o, len - o, "%c", *p);
+    } else if (p[1] == '%') {
+      used = snprintf(out + o, len - o, "%%");
+      p++;
+    } else {
+      size_t c = strspn(p + 1, "0123456789");
+      if (p[1 + c] != 'd' || c > 8)
+        return -1;
+      snprintf(conv, sizeof(conv), "%.*sd", (int)c + 1, p);
+      used = snprintf(out + o, len - o, conv, frame);
+      p += c + 1;
+    }
+    if (used < 0 || (size_t)used >= len - o)
+      return -1;
+    o += used;
+  }
+  if (o == 0)
+    out[0] = 0;
+  return 0;
+}
+
+/* a layer of frame: spec is file[@x,y[,scale[,parallax]]][:opacity] with
+ * the parameters as in fftrack_eval, or a generator. the file goes to name
+ */
+static int fflayer_parse(fflayer_t *l, const char *spec, int frame,
+                         const float32_t *camera, char *name, size_t len) {
+  float opacity = 1.0, xf[4] = {0.0, 0.0, 1.0, 1.0};
+  if ((size_t)snprintf(name, len, "%s", spec) >= len)
+    return -1;
+  if (!ffgen_is(spec)) {
+    // effects are decoded along with the name, see open_pngf32
+    const char *bar = strchr(spec, '|');
+    if (bar != NULL)
+      name[bar - spec] = '\0';
+    char *colon = strchr(name, ':');
+    if (colon != NULL) {
+      *colon = 0;
+      if (fftrack_eval(colon + 1, frame, &opacity))
+        return -1;
+    }
+    char *at = strrchr(name, '@');
+    if (at != NULL) {
+      // x, y, scale and parallax, keyframes have no commas
+      int k = 0;
+      *at = 0;
+      for (char *p = at + 1; ; k++, p++) {
+        char *comma = strchr(p, ',');
+        if (k == 4)
+          return -1;
+        if (comma != NULL)
+          *comma = 0;
+        if (fftrack_eval(p, frame, &xf[k]))
+          return -1;
+        if (comma == NULL)
+          break;
+        p = comma;
+      }
+      if (k < 1 || xf[2] <= 0.0f)
+        return -1;
+      xf[0] -= xf[3] * camera[0];
+      xf[1] -= xf[3] * camera[1];
+    }
+    // a placed layer is padded for its effects
+    size_t end = strlen(name);
+    if (bar != NULL && (size_t)snprintf(name + end, len - end, "%s%s",
+                                        at != NULL ? "@0,0" : "", bar) >= len - end)
+      return -1;
+  } else {
+    // the generator stays as it is, its opacity changes over frames
+    char *fade = ffgen_opacity(name);
+    if (fade != NULL && fftrack_eval(fade, frame, &opacity))
+      return -1;
+  }
+  l->opacity = opacity;
+  l->x = xf[0];
+  l->y = xf[1];
+  l->scale = xf[2];
+  return 0;
+}
+
+/* fields: first-last[@x,y], output pattern, then the chain of n - 2
+ * arguments, camera the x,y if any. frames go to enc as they are flattened
+ */
+static int flatten_range(char **fields, int n, int first, int last,
+                         char *camera, ffencode_t *enc) {
+  char *camy = camera != NULL ? strchr(camera, ',') : NULL;
+  if (camera != NULL && camy == NULL) {
+    fprintf(stderr, "%s: expected first-last@x,y\n", fields[0]);
+    return 1;
+  }
+  int nlayers = (n - 2) / 2 + 1, ret = 0;
+  fflayer_t *keep = calloc(nlayers, sizeof(*keep));
+  char **chain = malloc(sizeof(*chain) * (n - 2));
+  assert(keep != NULL && chain != NULL);
+  for (int i = 1; i < n - 2; i += 2)
+    chain[i] = fields[2 + i];
+
+  char spec[PATH_MAX], name[PATH_MAX], out[PATH_MAX];
+  for (int frame = first; frame <= last && !ret; frame++) {
+    float32_t cam[2] = {0.0, 0.0};
+    if (camera != NULL) {
+      *camy = 0;
+      int bad = fftrack_eval(camera, frame, &cam[0]) ||
+                fftrack_eval(camy + 1, frame, &cam[1]);
+      *camy = ',';
+      if (bad) {
+        fprintf(stderr, "%s: bad camera for frame %d\n", fields[0], frame);
+        ret = 1;
+        break;
+      }
+    }
+    for (int i = 0; i < nlayers; i++) {
+      if (ffrange_expand(fields[2 + i * 2], frame, spec, sizeof(spec)) ||
+          fflayer_parse(&keep[i], spec, frame, cam, name, sizeof(name))) {
+        fprintf(stderr, "%s: bad layer for frame %d\n", fields[2 + i * 2], frame);
+        ret = 1;
+        break;
+      }
+      if (keep[i].name == NULL || strcmp(keep[i].name, name)) {
+        if (keep[i].img != NULL)
+          free_imgf32(keep[i].img);
+        keep[i].img = NULL;
+        free(keep[i].name);
+        keep[i].name = strdup(name);
+        assert(keep[i].name != NULL);
+      }
+      chain[i * 2] = keep[i].name;
+    }
+    if (ret)
+      break;
+    if (ffrange_expand(fields[1], frame, out, sizeof(out))) {
+      fprintf(stderr, "%s: bad output pattern\n", fields[1]);
+      ret = 1;
+      break;
+    }
+
+    imgf32_t *img = flatten_chain(chain, n - 2, keep);
+    if (img == NULL) {
+      ret = 1;
+      break;
+    }
+    ffencode_push(enc, img, out);
+    fprintf(stderr, "FLATTEN %s\n", out);
+  }
+
+  for (int i = 0; i < nlayers; i++) {
+    if (keep[i].img != NULL)
+      free_imgf32(keep[i].img);
+    free(keep[i].name);
+  }
+  free(keep);
+  free(chain);
+  return ret;
+}
+
+static int flatten_batch(const char *list) {
+  FILE *fp = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  if (fp == NULL) {
+    perror(list);
+    return 1;
+  }
+
+  ffencode_t enc;
+  ffencode_start(&enc);
+  char *line = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+  int ret = 0, lineno = 0;
+  while ((len = getline(&line, &alloc, fp)) > 0) {
+    lineno++;
+    if (line[len - 1] == '\n')
+      line[--len] = 0;
+    if (len == 0)
+      continue;
+
+    char *fields[2 * 256 + 1];
+    int n = 0;
+    for (char *f = line; f != NULL && n < 2 * 256 + 1; n++) {
+      fields[n] = f;
+      f = strchr(f, '\t');
+      if (f != NULL)
+        *f++ = 0;
+    }
+    int first, last, end = 0;
+    if (n >= 2 && sscanf(fields[0], "%d-%d%n", &first, &last, &end) == 2 &&
+        (!fields[0][end] || fields[0][end] == '@')) {
+      if (n < 3 || !(n & 1)) {
+        fprintf(stderr, "%s:%d: expected first-last<TAB>output pattern"
+                "<TAB>base.png(<TAB>op<TAB>top.png)*\n", list, lineno);
+        ret = 1;
+        break;
+      }
+      char *camera = fields[0][end] == '@' ? fields[0] + end + 1 : NULL;
+      if (flatten_range(fields, n, first, last, camera, &enc)) {
+        ret = 1;
+        break;
+      }
+      continue;
+    }
+    if (n < 2 || (n & 1)) {
+      fprintf(stderr, "%s:%d: expected output<TAB>base.png(<TAB>op<TAB>top.png)*\n",
+              list, lineno);
+      ret = 1;
+      break;
+    }
+
+    imgf32_t *img = flatten_chain(fields + 1, n - 1, NULL);
+    if (img == NULL) {
+      ret = 1;
+      break;
+    }
+    ffencode_push(&enc, img, fields[0]);
+    fprintf(stderr, "FLATTEN %s\n", fields[0]);
+  }
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+  if (ffencode_finish(&enc))
+    ret = 1;
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
   int  ret = 1;
   if (argc == 2 && !strcmp(argv[1], "license")) {
     fprintf(stderr, 
@@ -1069,6 +3964,40 @@ int main(int argc, char *argv[]) {
    );
    return 0;
   }
+  const char *filter = getenv("FFLATTEN_FILTER");
+  ffsample_cubic = filter != NULL && !strcmp(filter, "bicubic");
+
+  while (argc >= 3 && !strncmp(argv[1], "--", 2)) {
+    char *end;
+    if (!strcmp(argv[1], "--scale")) {
+      if (!strcmp(argv[2], "1/2"))
+        ffproxy = 2;
+      else if (!strcmp(argv[2], "1/4"))
+        ffproxy = 4;
+      else if (strcmp(argv[2], "1")) {
+        fprintf(stderr, "--scale is 1, 1/2 or 1/4\n");
+        return 1;
+      }
+    } else if (!strcmp(argv[1], "--resize")) {
+      ffresize_width = ffresize_dim(argv[2], &end);
+      ffresize_height = *end == 'x' ? ffresize_dim(end + 1, &end) : 0;
+      if (ffresize_width == 0 || ffresize_height == 0 ||
+          (*end && strcmp(end, ":mitchell") && strcmp(end, ":lanczos"))) {
+        fprintf(stderr, "--resize is WxH[:lanczos|mitchell], "
+                        "each side 1 to %d\n", FFRESIZE_MAX);
+        return 1;
+      }
+      ffresize_mitchell = !strcmp(end, ":mitchell");
+    } else {
+      break;
+    }
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+
+  if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "-b"))
+    return flatten_batch(argc == 3 ? argv[2] : "-");
   if (argc & 1) {
     fprintf(stderr, "fflatten "
 #ifdef FFLATTEN_INTRINSICS_USED
@@ -1077,7 +4006,33 @@ int main(int argc, char *argv[]) {
       "without"
 #endif
     " intrinscs \n");
-    fprintf(stderr, "usage: %s base.png[:opacity] (<operator> top.png[:opacity])*\n", argv[0]);
+    fprintf(stderr, "usage: %s base.png[:opacity] (<operator> top.png[@x,y[,scale]][:opacity])*\n", argv[0]);
+    fprintf(stderr, "  top.png@x,y puts a top smaller than the base at x,y, only that area is blended\n");
+    fprintf(stderr, "  fractions of a pixel and a scale resample it, FFLATTEN_FILTER=bicubic or bilinear\n");
+    fprintf(stderr, "  a top may also be generated: #rrggbb[aa], grad:linear:x0,y0,x1,y1:#from:#to\n"
+                    "  or grad:radial:x,y,r:#from:#to\n");
+    fprintf(stderr, "  or an adjustment of the composite under it: levels:black,white[,gamma[,\n"
+                    "  out black,out white]], curves:x,y/x,y/...[:green:blue] or hsl:h,s,l\n"
+                    "  generated tops take a trailing :opacity as well, as in levels:0,0.9:0.5\n");
+    fprintf(stderr, "  a png may take effects after a |, as in top.png@x,y:0.8|shadow:4,4,3|blur:1\n");
+    fprintf(stderr, "  blur:r, glow:r:strength or shadow:dx,dy,r[:#rrggbb[aa]], r in pixels\n");
+    fprintf(stderr, "  any png may also be a member of a tar, tar.gz or tar.zst: cut.tar.zst#0012.png\n");
+    fprintf(stderr, "  or \"-\", read from stdin\n");
+    fprintf(stderr, "  FFLATTEN_CACHE=<dir> keeps decoded layers in <dir> for later runs\n");
+    fprintf(stderr, "  FFLATTEN_JOBS=<n> decodes up to n layers and encodes up to n frames at once,\n"
+                    "  one per core by default\n");
+    fprintf(stderr, "usage: %s -b [list]\n", argv[0]);
+    fprintf(stderr, "  flattens a frame per line of list (or stdin), tab separated:\n");
+    fprintf(stderr, "  output.png base.png[:opacity] (<operator> top.png[@x,y][:opacity])*\n");
+    fprintf(stderr, "  or a range of frames, with %%d in the output and layers as the frame:\n");
+    fprintf(stderr, "  first-last[@x,y] output%%04d.png base.png[:opacity]\n"
+                    "  (<operator> top.png[@x,y[,scale[,parallax]]][:opacity])*\n");
+    fprintf(stderr, "  where any number may be keyframes, lin(frame=value/...) or ease(...), and\n"
+                    "  @x,y after the range is a camera, moving placed tops by -parallax*x,y\n");
+    fprintf(stderr, "usage: %s --scale 1/2|1/4 ...\n", argv[0]);
+    fprintf(stderr, "  a proxy, every layer shrunk as it is decoded and blended at that size\n");
+    fprintf(stderr, "usage: %s --resize WxH[:lanczos|mitchell] ...\n", argv[0]);
+    fprintf(stderr, "  resizes the output, Lanczos-3 by default\n");
     fprintf(stderr, "usage: %s license\n", argv[0]);
     fprintf(stderr, "operator:\n");
     PRINT_BLEND_OP(BASE       );
@@ -1103,54 +4058,12 @@ int main(int argc, char *argv[]) {
     return 1; 
   }
 
-  imgf32_t *base_img = open_pngf32(argv[1]);
+  imgf32_t *base_img = flatten_chain(argv + 1, argc - 1, NULL);
   imgf32_t *top_img = NULL;
   if (base_img == NULL)
-      goto clean;
-
-  for (int cur = 2; cur < argc; ) {
-    char op = argv[cur++][0];
-    top_img = open_pngf32(argv[cur++]);
-    if (top_img == NULL)
-      goto clean;
-  
-    if (base_img->width != top_img->width ||
-        base_img->height != top_img->height) {
-      fprintf(stderr, "base and top must have the same width and height\n");
-      goto clean;
-    }
-  
-    switch (op) {
-    DEFINE_BLEND_CASE(BASE       ,base_img, top_img);
-    DEFINE_BLEND_CASE(TOP        ,base_img, top_img);
-    DEFINE_BLEND_CASE(NORMAL     ,base_img, top_img);
-    DEFINE_BLEND_CASE(ADDITION   ,base_img, top_img);
-    DEFINE_BLEND_CASE(COLOR      ,base_img, top_img);
-    DEFINE_BLEND_CASE(COLOR_DODGE,base_img, top_img);
-    DEFINE_BLEND_CASE(DIFFERENCE ,base_img, top_img);
-    DEFINE_BLEND_CASE(DARKEN     ,base_img, top_img);
-    DEFINE_BLEND_CASE(DIVIDE     ,base_img, top_img);
-    DEFINE_BLEND_CASE(GAMMA_LIGHT,base_img, top_img);
-    DEFINE_BLEND_CASE(GAMMA_DARK ,base_img, top_img);
-    DEFINE_BLEND_CASE(HUE        ,base_img, top_img);
-    DEFINE_BLEND_CASE(LIGHTEN    ,base_img, top_img);
-    DEFINE_BLEND_CASE(LUMINOSITY ,base_img, top_img);
-    DEFINE_BLEND_CASE(MULTIPLY   ,base_img, top_img);
-    DEFINE_BLEND_CASE(OVERLAY    ,base_img, top_img);
-    DEFINE_BLEND_CASE(SATURATION ,base_img, top_img);
-    DEFINE_BLEND_CASE(SCREEN     ,base_img, top_img);
-    DEFINE_BLEND_CASE(SOFT_LIGHT ,base_img, top_img);
-    DEFINE_BLEND_CASE(HARD_LIGHT ,base_img, top_img);
-    default:
-      fprintf(stderr, "invalid op '%c'\n", op);
-      goto clean;
-    }
-
-    fprintf(stderr, "'%c' -> %s\n", op, argv[cur - 1]);
-    free_imgf32(top_img);
-    top_img = NULL;
-  }
+    goto clean;
   write_pngf32(base_img, stdout);
+  ret = 0;
 
 #ifdef FFDEBUG
 
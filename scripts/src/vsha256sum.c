@@ -20,17 +20,46 @@
 *********************************************************************/
 
 /*************************** HEADER FILES ***************************/
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <memory.h>
 #include <ctype.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
 #include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
 
+/* Multi-buffer SHA256 hashes SHA256_MB_LANES independent messages in
+ * lock-step, one message per vector lane. A single stream can not use
+ * the SIMD width because every round depends on the previous one, but
+ * many files can. The lane count follows the target vector width:
+ * AVX-512 gives 16, AVX2 gives 8, SSE2 and NEON give 4. On x86_64 only
+ * SSE2 is assumed unless built with VSHA256SUM_NATIVE (see Makefile).
+ */
+#if defined(__AVX512F__)
+#define SHA256_MB_LANES 16
+#elif defined(__AVX2__)
+#define SHA256_MB_LANES 8
+#else
+#define SHA256_MB_LANES 4
+#endif
+
+// initial read buffer for -c inputs that can not be mapped
+#define SHA256_MB_BUFSIZE (64 * 1024)
+
 /**************************** DATA TYPES ****************************/
 
 typedef struct {
@@ -40,6 +69,12 @@ typedef struct {
 	uint32_t state[8];
 } SHA256_CTX;
 
+typedef uint32_t sha256_vec_t __attribute__((vector_size(4 * SHA256_MB_LANES)));
+
+typedef struct {
+	sha256_vec_t state[8];
+} SHA256_MB_CTX;
+
 /****************************** MACROS ******************************/
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
 #define ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
@@ -121,9 +156,17 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const uint8_t data[], size_t len)
 {
-	uint32_t i;
+	size_t i = 0;
 
-	for (i = 0; i < len; ++i) {
+	// whole blocks are hashed in place instead of through ctx->data
+	if (ctx->datalen == 0) {
+		for ( ; i + 64 <= len; i += 64) {
+			sha256_transform(ctx, data + i);
+			ctx->bitlen += 512;
+		}
+	}
+
+	for ( ; i < len; ++i) {
 		ctx->data[ctx->datalen] = data[i];
 		ctx->datalen++;
 		if (ctx->datalen == 64) {
@@ -180,53 +223,1157 @@ void sha256_final(SHA256_CTX *ctx, uint8_t hash[])
 	}
 }
 
+/* The macros above only use shifts and bitwise operators, which GCC and
+ * clang vector extensions apply per lane. The same round function
+ * therefore compiles to SSE2/AVX2/AVX-512 or NEON.
+ */
+void sha256_mb_transform(SHA256_MB_CTX *ctx, const uint8_t *data[])
+{
+	sha256_vec_t a, b, c, d, e, f, g, h, t1, t2, m[64];
+	uint32_t i, j, l;
+
+	for (i = 0, j = 0; i < 16; ++i, j += 4)
+		for (l = 0; l < SHA256_MB_LANES; ++l)
+			m[i][l] = ((uint32_t)data[l][j] << 24) | ((uint32_t)data[l][j + 1] << 16) |
+			          ((uint32_t)data[l][j + 2] << 8) | ((uint32_t)data[l][j + 3]);
+	for ( ; i < 64; ++i)
+		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+
+	for (i = 0; i < 64; ++i) {
+		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+		t2 = EP0(a) + MAJ(a,b,c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+// loads a scalar context into one lane
+static void sha256_mb_set_lane(SHA256_MB_CTX *mb, int lane, const SHA256_CTX *ctx)
+{
+	for (int i = 0; i < 8; i++)
+		mb->state[i][lane] = ctx->state[i];
+}
+
+// stores one lane back into a scalar context
+static void sha256_mb_get_lane(const SHA256_MB_CTX *mb, int lane, SHA256_CTX *ctx)
+{
+	for (int i = 0; i < 8; i++)
+		ctx->state[i] = mb->state[i][lane];
+}
+
 static uint8_t a2b(uint8_t x) {
   if (x <= '9')
     return x - '0';
   return (10 + x) - 'a';
 }
 
-int main(int argc, char **argv)
+/* parses a hex digest of exactly SHA256_BLOCK_SIZE*2 letters. returns 0
+ * on success
+ */
+static int parse_digest(const char *hex, size_t len, uint8_t dgest[])
 {
-	SHA256_CTX ctx;
 	uint8_t recvs[SHA256_BLOCK_SIZE*2];
+
+	if (len != SHA256_BLOCK_SIZE*2)
+		return -1;
+
+	memcpy(recvs, hex, SHA256_BLOCK_SIZE*2);
+	for (int i = 0; i < SHA256_BLOCK_SIZE*2; i++) {
+		if (!isxdigit(recvs[i]))
+			return -1;
+		// to lower
+		if (recvs[i] >= 'A' && recvs[i] <= 'F')
+			recvs[i] = 'a' + (recvs[i] - 'A');
+	}
+
+	for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+		dgest[i] = (a2b(recvs[i*2]) << 4) | a2b(recvs[(i*2) + 1]);
+	return 0;
+}
+
+/************************** MANIFEST CHECK **************************/
+
+enum {
+	CHECK_PENDING = 0,
+	CHECK_OK,
+	CHECK_FAILED,
+	CHECK_UNREADABLE
+};
+
+typedef struct {
+	char *name;
 	uint8_t rdgest[SHA256_BLOCK_SIZE];
+	int status;
+	int err;
+} check_job;
+
+/* a lane owns one whole file, either mmap(2)ed or, for pipes and other
+ * files that can not be mapped, read into memory
+ */
+typedef struct {
+	check_job *job;
+	uint8_t *map;
+	size_t size, pos;
+	int mapped;
+	SHA256_CTX ctx;
+} check_lane;
+
+/* the pool is a shared cursor into the job list. every worker runs its
+ * own multi-buffer context and pulls the next job whenever a lane drains.
+ */
+typedef struct {
+	check_job *jobs;
+	long njobs;
+	long next;
+	pthread_mutex_t lock;
+} check_pool;
+
+// undoes the "\\" and "\n" escapes of names with a leading backslash
+static void unescape_name(char *name)
+{
+	char *d = name;
+	for (char *s = name; *s; s++) {
+		if (*s == '\\' && s[1] == 'n') {
+			*d++ = '\n';
+			s++;
+		} else if (*s == '\\' && s[1] == 'r') {
+			*d++ = '\r';
+			s++;
+		} else if (*s == '\\' && s[1] == '\\') {
+			*d++ = '\\';
+			s++;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = 0;
+}
+
+/* prints a name the way sha256sum(1) does: names with line breaks are
+ * escaped behind a backslash
+ */
+static void print_name(const char *name)
+{
+	if (strpbrk(name, "\n\r") == NULL) {
+		fputs(name, stdout);
+		return;
+	}
+	putchar('\\');
+	for (; *name; name++) {
+		if (*name == '\\')
+			fputs("\\\\", stdout);
+		else if (*name == '\n')
+			fputs("\\n", stdout);
+		else if (*name == '\r')
+			fputs("\\r", stdout);
+		else
+			putchar(*name);
+	}
+}
+
+/* parses one manifest line, either "[\]<hex>  <name>", "[\]<hex> *<name>"
+ * or the BSD tagged "SHA256 (<name>) = <hex>". returns 0 on success
+ */
+static int parse_manifest_line(char *line, size_t l, check_job *job)
+{
+	int escaped = 0;
+	char *name;
+
+	if (line[0] == '\\') {
+		escaped = 1;
+		line++;
+		l--;
+	}
+
+	if (!strncmp(line, "SHA256 (", 8)) {
+		char *end = line + l - (SHA256_BLOCK_SIZE*2 + 4);
+		if (l < 8 + SHA256_BLOCK_SIZE*2 + 4 || strncmp(end, ") = ", 4) ||
+		    parse_digest(end + 4, SHA256_BLOCK_SIZE*2, job->rdgest))
+			return -1;
+		*end = 0;
+		name = line + 8;
+	} else {
+		if (l < SHA256_BLOCK_SIZE*2 + 3 ||
+		    parse_digest(line, SHA256_BLOCK_SIZE*2, job->rdgest) ||
+		    line[SHA256_BLOCK_SIZE*2] != ' ' ||
+		    (line[SHA256_BLOCK_SIZE*2 + 1] != ' ' && line[SHA256_BLOCK_SIZE*2 + 1] != '*'))
+			return -1;
+		name = line + SHA256_BLOCK_SIZE*2 + 2;
+	}
+
+	job->name = strdup(name);
+	assert(job->name != NULL);
+	if (escaped)
+		unescape_name(job->name);
+	job->status = CHECK_PENDING;
+	job->err = 0;
+	return 0;
+}
+
+/* reads a sha256sum(1) manifest. returns the number of entries or -1.
+ * lines that can not be parsed are counted in *bad
+ */
+static long read_manifest(const char *path, check_job **jobs, long *bad)
+{
+	FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (fp == NULL) {
+		fprintf(stderr, "vsha256sum: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t cap = 0;
+	long n = 0, alloc = 0;
+	ssize_t l;
+	*jobs = NULL;
+	*bad = 0;
+	while ((l = getline(&line, &cap, fp)) != -1) {
+		while (l > 0 && (line[l - 1] == '\n' || line[l - 1] == '\r'))
+			line[--l] = 0;
+		if (l == 0 || line[0] == '#')
+			continue;
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			*jobs = realloc(*jobs, sizeof(**jobs) * alloc);
+			assert(*jobs != NULL);
+		}
+		if (parse_manifest_line(line, l, &(*jobs)[n])) {
+			(*bad)++;
+			continue;
+		}
+		n++;
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return n;
+}
+
+/* maps a file into the lane. regular files are mmap(2)ed with
+ * MADV_SEQUENTIAL so the kernel reads ahead aggressively; anything else
+ * is slurped with read(2). returns 0 or an errno
+ */
+static int lane_load(check_lane *lane, const char *name)
+{
+	struct stat st;
+	int fd = strcmp(name, "-") ? open(name, O_RDONLY) : dup(0);
+	if (fd < 0)
+		return errno;
+	if (fstat(fd, &st)) {
+		int err = errno;
+		close(fd);
+		return err;
+	}
+
+	lane->map = NULL;
+	lane->size = 0;
+	lane->mapped = 0;
+	if (S_ISDIR(st.st_mode)) {
+		close(fd);
+		return EISDIR;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			lane->map = map;
+			lane->size = st.st_size;
+			lane->mapped = 1;
+			close(fd);
+			return 0;
+		}
+	}
+
+	size_t cap = 0;
+	ssize_t l;
+	do {
+		if (lane->size == cap) {
+			cap = cap ? cap * 2 : SHA256_MB_BUFSIZE;
+			lane->map = realloc(lane->map, cap);
+			assert(lane->map != NULL);
+		}
+		l = read(fd, lane->map + lane->size, cap - lane->size);
+		if (l > 0)
+			lane->size += l;
+	} while (l > 0 || (l < 0 && errno == EINTR));
+	if (l < 0) {
+		int err = errno;
+		free(lane->map);
+		close(fd);
+		return err;
+	}
+	close(fd);
+	return 0;
+}
+
+static void lane_unload(check_lane *lane)
+{
+	if (lane->mapped)
+		munmap(lane->map, lane->size);
+	else
+		free(lane->map);
+	lane->map = NULL;
+}
+
+// attaches the next job that can be opened. returns 0 if none are left
+static int lane_open(check_lane *lane, check_pool *pool)
+{
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		check_job *job = pool->next < pool->njobs ? &pool->jobs[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (job == NULL)
+			break;
+
+		job->err = lane_load(lane, job->name);
+		if (job->err) {
+			job->status = CHECK_UNREADABLE;
+			continue;
+		}
+		lane->job = job;
+		lane->pos = 0;
+		sha256_init(&lane->ctx);
+		return 1;
+	}
+	lane->job = NULL;
+	return 0;
+}
+
+// hashes the tail of a drained lane and records the verdict
+static void lane_finish(check_lane *lane, const SHA256_MB_CTX *mb, int l)
+{
 	uint8_t odgest[SHA256_BLOCK_SIZE];
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <sha256>\n", argv[0]);
+
+	sha256_mb_get_lane(mb, l, &lane->ctx);
+	sha256_update(&lane->ctx, lane->map + lane->pos, lane->size - lane->pos);
+	sha256_final(&lane->ctx, odgest);
+	lane_unload(lane);
+	lane->job->status = memcmp(odgest, lane->job->rdgest, SHA256_BLOCK_SIZE) ?
+	                    CHECK_FAILED : CHECK_OK;
+}
+
+/* Files are streamed through the lanes of one SHA256_MB_CTX; whenever a
+ * file runs out of full blocks its lane is finished with the scalar code
+ * and refilled with the next file from the pool.
+ */
+static void *check_worker(void *arg)
+{
+	static const uint8_t idle[64];
+	check_pool *pool = arg;
+	check_lane lanes[SHA256_MB_LANES];
+	const uint8_t *data[SHA256_MB_LANES];
+	SHA256_MB_CTX mb;
+
+	for (int l = 0; l < SHA256_MB_LANES; l++)
+		if (lane_open(&lanes[l], pool))
+			sha256_mb_set_lane(&mb, l, &lanes[l].ctx);
+
+	while (1) {
+		int active = 0;
+		for (int l = 0; l < SHA256_MB_LANES; l++) {
+			check_lane *lane = &lanes[l];
+			data[l] = idle;
+			while (lane->job != NULL) {
+				if (lane->size - lane->pos >= 64) {
+					data[l] = lane->map + lane->pos;
+					active++;
+					break;
+				}
+				lane_finish(lane, &mb, l);
+				if (lane_open(lane, pool))
+					sha256_mb_set_lane(&mb, l, &lane->ctx);
+			}
+		}
+		if (!active)
+			break;
+
+		sha256_mb_transform(&mb, data);
+		for (int l = 0; l < SHA256_MB_LANES; l++) {
+			if (data[l] == idle)
+				continue;
+			lanes[l].pos += 64;
+			lanes[l].ctx.bitlen += 512;
+		}
+	}
+	return NULL;
+}
+
+/* verifies every entry of a manifest on nthreads workers. the output
+ * and exit status follow sha256sum -c
+ */
+static int check_manifest(const char *path, long nthreads)
+{
+	check_pool pool;
+	long bad;
+	pool.njobs = read_manifest(path, &pool.jobs, &bad);
+	if (pool.njobs < 0)
+		return 1;
+	if (pool.njobs == 0) {
+		fprintf(stderr, "vsha256sum: %s: no properly formatted checksum lines found\n", path);
+		free(pool.jobs);
 		return 1;
 	}
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
 
-	if (strlen(argv[1]) != SHA256_BLOCK_SIZE*2) {
-		fprintf(stderr, "digest too short. expecting %d letters\n", SHA256_BLOCK_SIZE*2);
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > (pool.njobs + SHA256_MB_LANES - 1) / SHA256_MB_LANES)
+		nthreads = (pool.njobs + SHA256_MB_LANES - 1) / SHA256_MB_LANES;
+
+	pthread_t *threads = malloc(sizeof(*threads) * nthreads);
+	assert(threads != NULL);
+	for (long i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, check_worker, &pool))
+			abort();
+	for (long i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+
+	long failed = 0, unreadable = 0;
+	for (long i = 0; i < pool.njobs; i++) {
+		check_job *job = &pool.jobs[i];
+		if (job->status == CHECK_UNREADABLE) {
+			fprintf(stderr, "vsha256sum: %s: %s\n", job->name, strerror(job->err));
+			unreadable++;
+		} else if (job->status == CHECK_FAILED) {
+			failed++;
+		}
+		print_name(job->name);
+		puts(job->status == CHECK_OK ? ": OK" :
+		     job->status == CHECK_FAILED ? ": FAILED" : ": FAILED open or read");
+		free(job->name);
+	}
+	free(pool.jobs);
+	fflush(stdout);
+
+	if (bad)
+		fprintf(stderr, "vsha256sum: WARNING: %ld line%s improperly formatted\n",
+		        bad, bad > 1 ? "s are" : " is");
+	if (unreadable)
+		fprintf(stderr, "vsha256sum: WARNING: %ld listed file%s could not be read\n",
+		        unreadable, unreadable > 1 ? "s" : "");
+	if (failed)
+		fprintf(stderr, "vsha256sum: WARNING: %ld computed checksum%s did NOT match\n",
+		        failed, failed > 1 ? "s" : "");
+	return failed || unreadable;
+}
+
+/*************************** STREAM STATS ***************************/
+
+/* with -l <label>, the stream modes report their throughput on stderr as
+ * one line of key=value pairs per event, about once a second while data
+ * flows and once when the stream ends:
+ *
+ *     vsha256sum: label=<label> event=progress bytes=<n> elapsed=<s> rate=<bytes/s>
+ *     vsha256sum: label=<label> event=done bytes=<n> elapsed=<s> rate=<bytes/s> status=<OK|FAILED>
+ *
+ * bytes only counts stdin, so resumed or cached data does not inflate
+ * the rate.
+ */
+
+typedef struct {
+	const char *label;
+	struct timespec start, last;
+	uint64_t bytes;
+} stream_stats;
+
+static stream_stats stats;
+
+static double seconds_since(const struct timespec *t)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+static void stats_report(const char *event, const char *status)
+{
+	double elapsed = seconds_since(&stats.start);
+	fprintf(stderr, "vsha256sum: label=%s event=%s bytes=%" PRIu64 " elapsed=%.3f rate=%.0f",
+	        stats.label, event, stats.bytes, elapsed,
+	        elapsed > 0 ? stats.bytes / elapsed : 0.0);
+	if (status != NULL)
+		fprintf(stderr, " status=%s", status);
+	fputs("\n", stderr);
+}
+
+static void stats_start(const char *label)
+{
+	stats.label = label;
+	stats.bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	stats.last = stats.start;
+}
+
+static void stats_add(size_t n)
+{
+	stats.bytes += n;
+	if (stats.label == NULL || seconds_since(&stats.last) < 1.0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &stats.last);
+	stats_report("progress", NULL);
+}
+
+// reports the end of the stream and passes ret through
+static int stats_done(int ret)
+{
+	if (stats.label != NULL)
+		stats_report("done", ret ? "FAILED" : "OK");
+	return ret;
+}
+
+/************************** CHUNKED STREAM **************************/
+
+/* A chunk list splits a stream into fixed size chunks and records the
+ * digest of each one:
+ *
+ *     chunk <bytes>
+ *     <sha256 of chunk 0>
+ *     <sha256 of chunk 1>
+ *     ...
+ *
+ * The list itself is authenticated by its root,
+ *
+ *     root = SHA256(be64(bytes) || digest 0 || digest 1 || ...)
+ *
+ * which is all build.sh has to pin. Every chunk is verified before any of
+ * its bytes are written, so the extractor never sees unverified data.
+ */
+
+// chunks are hashed in lock-step, hence a multiple of the block size
+#define CHUNK_ALIGN 64
+#define CHUNK_MAX (64 * 1024 * 1024)
+
+typedef struct {
+	size_t size;
+	long n;
+	uint8_t (*dgests)[SHA256_BLOCK_SIZE];
+} chunk_list;
+
+static void print_digest(FILE *fp, const uint8_t dgest[])
+{
+	for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+		fprintf(fp, "%02x", dgest[i]);
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t l = write(fd, buf, len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += l;
+		len -= l;
+	}
+	return 0;
+}
+
+// reads until buf is full or the stream ends. returns the bytes read
+static size_t read_full(FILE *fp, uint8_t *buf, size_t len)
+{
+	size_t got = 0;
+	while (got < len) {
+		size_t l = fread(buf + got, 1, len - got, fp);
+		if (l == 0)
+			break;
+		got += l;
+	}
+	return got;
+}
+
+/* hashes up to SHA256_MB_LANES chunks. chunks of the full chunk size run
+ * in lock-step through the vector lanes, a short last chunk goes through
+ * the scalar code
+ */
+static void sha256_chunks(uint8_t *bufs[], const size_t lens[], int n, size_t size,
+                          uint8_t dgests[][SHA256_BLOCK_SIZE])
+{
+	static const uint8_t idle[64];
+	const uint8_t *data[SHA256_MB_LANES];
+	SHA256_CTX ctx[SHA256_MB_LANES];
+	SHA256_MB_CTX mb;
+
+	for (int l = 0; l < SHA256_MB_LANES; l++) {
+		sha256_init(&ctx[l]);
+		sha256_mb_set_lane(&mb, l, &ctx[l]);
+	}
+
+	for (size_t off = 0; off < size; off += 64) {
+		for (int l = 0; l < SHA256_MB_LANES; l++)
+			data[l] = l < n && lens[l] == size ? bufs[l] + off : idle;
+		sha256_mb_transform(&mb, data);
+	}
+
+	for (int l = 0; l < n; l++) {
+		if (lens[l] == size) {
+			sha256_mb_get_lane(&mb, l, &ctx[l]);
+			ctx[l].bitlen = (uint64_t)size * 8;
+		} else {
+			sha256_update(&ctx[l], bufs[l], lens[l]);
+		}
+		sha256_final(&ctx[l], dgests[l]);
+	}
+}
+
+static void chunk_root(const chunk_list *list, uint8_t root[])
+{
+	SHA256_CTX ctx;
+	uint8_t be[8];
+
+	for (int i = 0; i < 8; i++)
+		be[i] = (uint64_t)list->size >> (56 - i * 8);
+	sha256_init(&ctx);
+	sha256_update(&ctx, be, sizeof(be));
+	sha256_update(&ctx, (void *)list->dgests, (size_t)list->n * SHA256_BLOCK_SIZE);
+	sha256_final(&ctx, root);
+}
+
+static int read_chunk_list(const char *path, chunk_list *list)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "vsha256sum: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t cap = 0;
+	long alloc = 0;
+	ssize_t l;
+	int ret = -1;
+	list->n = 0;
+	list->dgests = NULL;
+	if ((l = getline(&line, &cap, fp)) == -1 ||
+	    sscanf(line, "chunk %zu", &list->size) != 1 ||
+	    list->size == 0 || list->size % CHUNK_ALIGN || list->size > CHUNK_MAX) {
+		fprintf(stderr, "vsha256sum: %s: invalid chunk size\n", path);
+		goto out;
+	}
+	while ((l = getline(&line, &cap, fp)) != -1) {
+		while (l > 0 && (line[l - 1] == '\n' || line[l - 1] == '\r'))
+			line[--l] = 0;
+		if (list->n == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			list->dgests = realloc(list->dgests, sizeof(*list->dgests) * alloc);
+			assert(list->dgests != NULL);
+		}
+		if (parse_digest(line, l, list->dgests[list->n])) {
+			fprintf(stderr, "vsha256sum: %s: invalid chunk digest\n", path);
+			goto out;
+		}
+		list->n++;
+	}
+	ret = 0;
+out:
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/* verifies stdin against a chunk list and forwards it to stdout chunk by
+ * chunk. SHA256_MB_LANES chunks are read ahead so they can be verified
+ * together. on a mismatch nothing past the last good chunk is written
+ */
+static int verify_chunked(const char *path, const char *roothex)
+{
+	uint8_t rroot[SHA256_BLOCK_SIZE], oroot[SHA256_BLOCK_SIZE];
+	uint8_t dgests[SHA256_MB_LANES][SHA256_BLOCK_SIZE];
+	uint8_t *bufs[SHA256_MB_LANES];
+	size_t lens[SHA256_MB_LANES];
+	chunk_list list;
+	long idx = 0;
+	int ret = 1;
+
+	if (parse_digest(roothex, strlen(roothex), rroot)) {
+		fprintf(stderr, "invalid argument digest\n");
 		return 1;
 	}
+	if (read_chunk_list(path, &list))
+		return 1;
 
-	memcpy(recvs, argv[1], SHA256_BLOCK_SIZE*2);
-	for (int i = 0; i < SHA256_BLOCK_SIZE*2; i++) {
-		if (!isxdigit(recvs[i])) {
-			fprintf(stderr, "invalid argument digest\n");
+	chunk_root(&list, oroot);
+	if (memcmp(oroot, rroot, SHA256_BLOCK_SIZE)) {
+		fprintf(stderr, "vsha256sum: %s: chunk list does not match its root\n", path);
+		fprintf(stderr, "  expected ");
+		print_digest(stderr, rroot);
+		fprintf(stderr, "\n  received ");
+		print_digest(stderr, oroot);
+		fputs("\n", stderr);
+		free(list.dgests);
+		return 1;
+	}
+
+	for (int l = 0; l < SHA256_MB_LANES; l++) {
+		bufs[l] = malloc(list.size);
+		assert(bufs[l] != NULL);
+	}
+
+	while (1) {
+		int n = 0;
+		while (n < SHA256_MB_LANES) {
+			lens[n] = read_full(stdin, bufs[n], list.size);
+			stats_add(lens[n]);
+			if (lens[n] == 0)
+				break;
+			n++;
+			if (lens[n - 1] < list.size)
+				break;
+		}
+		if (n == 0)
+			break;
+		if (idx + n > list.n) {
+			fprintf(stderr, "vsha256sum: stream is longer than %ld chunks\n", list.n);
+			goto out;
+		}
+
+		sha256_chunks(bufs, lens, n, list.size, dgests);
+		for (int l = 0; l < n; l++, idx++) {
+			if (memcmp(dgests[l], list.dgests[idx], SHA256_BLOCK_SIZE)) {
+				fprintf(stderr, "vsha256sum: chunk %ld does not match\n", idx);
+				fprintf(stderr, "  expected ");
+				print_digest(stderr, list.dgests[idx]);
+				fprintf(stderr, "\n  received ");
+				print_digest(stderr, dgests[l]);
+				fputs("\n", stderr);
+				goto out;
+			}
+			if (write_all(1, bufs[l], lens[l])) {
+				perror("vsha256sum: write");
+				goto out;
+			}
+		}
+		if (lens[n - 1] < list.size)
+			break;
+	}
+
+	if (ferror(stdin)) {
+		perror("vsha256sum: read");
+		goto out;
+	}
+	if (idx != list.n) {
+		fprintf(stderr, "vsha256sum: stream ended after %ld of %ld chunks\n", idx, list.n);
+		goto out;
+	}
+	ret = 0;
+out:
+	for (int l = 0; l < SHA256_MB_LANES; l++)
+		free(bufs[l]);
+	free(list.dgests);
+	return ret;
+}
+
+/* splits stdin into chunks of size bytes, writes their list to path and
+ * prints the root
+ */
+static int make_chunk_list(const char *sizestr, const char *path)
+{
+	uint8_t dgests[SHA256_MB_LANES][SHA256_BLOCK_SIZE];
+	uint8_t root[SHA256_BLOCK_SIZE];
+	uint8_t *bufs[SHA256_MB_LANES];
+	size_t lens[SHA256_MB_LANES];
+	chunk_list list = {0};
+	long alloc = 0;
+
+	list.size = strtoul(sizestr, NULL, 0);
+	if (list.size == 0 || list.size % CHUNK_ALIGN || list.size > CHUNK_MAX) {
+		fprintf(stderr, "chunk size must be a multiple of %d up to %d\n",
+		        CHUNK_ALIGN, CHUNK_MAX);
+		return 1;
+	}
+
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "vsha256sum: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	for (int l = 0; l < SHA256_MB_LANES; l++) {
+		bufs[l] = malloc(list.size);
+		assert(bufs[l] != NULL);
+	}
+
+	int n;
+	do {
+		for (n = 0; n < SHA256_MB_LANES; ) {
+			lens[n] = read_full(stdin, bufs[n], list.size);
+			if (lens[n] == 0)
+				break;
+			if (lens[n++] < list.size)
+				break;
+		}
+		sha256_chunks(bufs, lens, n, list.size, dgests);
+		if (list.n + n > alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			list.dgests = realloc(list.dgests, sizeof(*list.dgests) * alloc);
+			assert(list.dgests != NULL);
+		}
+		memcpy(list.dgests[list.n], dgests, sizeof(*dgests) * n);
+		list.n += n;
+	} while (n == SHA256_MB_LANES && lens[n - 1] == list.size);
+
+	fprintf(fp, "chunk %zu\n", list.size);
+	for (long i = 0; i < list.n; i++) {
+		print_digest(fp, list.dgests[i]);
+		fputs("\n", fp);
+	}
+	fclose(fp);
+
+	chunk_root(&list, root);
+	print_digest(stdout, root);
+	puts("");
+
+	for (int l = 0; l < SHA256_MB_LANES; l++)
+		free(bufs[l]);
+	free(list.dgests);
+	return 0;
+}
+
+/************************* RESUMABLE STREAM *************************/
+
+/* -C keeps the stream in a download file next to a sidecar checkpoint,
+ * <file>.ckpt, holding the SHA256 midstate at some offset:
+ *
+ *     vsha256sum checkpoint
+ *     digest <expected sha256>
+ *     offset <bytes>
+ *     bitlen <bits in state>
+ *     state <8 words>
+ *     data <partial block>
+ *
+ * A resumed run only hashes what the file holds past the checkpoint and
+ * then continues with stdin, which has to start where the file ends,
+ * e.g. curl -C <size of file>.
+ */
+
+#define CKPT_INTERVAL (16 * 1024 * 1024)
+#define STREAM_BUFSIZE (64 * 1024)
+
+static void ckpt_path(char *buf, size_t len, const char *path, const char *ext)
+{
+	if ((size_t)snprintf(buf, len, "%s%s", path, ext) >= len) {
+		fprintf(stderr, "vsha256sum: %s: name too long\n", path);
+		exit(1);
+	}
+}
+
+// atomically replaces the checkpoint of path
+static int save_checkpoint(const char *path, const uint8_t rdgest[], uint64_t offset,
+                           const SHA256_CTX *ctx)
+{
+	char tmp[PATH_MAX], ckpt[PATH_MAX];
+	ckpt_path(tmp, sizeof(tmp), path, ".ckpt.tmp");
+	ckpt_path(ckpt, sizeof(ckpt), path, ".ckpt");
+
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL)
+		return -1;
+	fprintf(fp, "vsha256sum checkpoint\ndigest ");
+	print_digest(fp, rdgest);
+	fprintf(fp, "\noffset %" PRIu64 "\nbitlen %" PRIu64 "\nstate", offset, ctx->bitlen);
+	for (int i = 0; i < 8; i++)
+		fprintf(fp, " %08" PRIx32, ctx->state[i]);
+	fprintf(fp, "\ndata ");
+	for (uint32_t i = 0; i < ctx->datalen; i++)
+		fprintf(fp, "%02x", ctx->data[i]);
+	fputs("\n", fp);
+	if (fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return rename(tmp, ckpt);
+}
+
+/* loads the checkpoint of path if it exists and was taken for the same
+ * digest. returns 0 on success
+ */
+static int load_checkpoint(const char *path, const uint8_t rdgest[], uint64_t *offset,
+                           SHA256_CTX *ctx)
+{
+	char ckpt[PATH_MAX], hex[SHA256_BLOCK_SIZE*2 + 1], data[129] = {0};
+	uint8_t dgest[SHA256_BLOCK_SIZE];
+	ckpt_path(ckpt, sizeof(ckpt), path, ".ckpt");
+
+	FILE *fp = fopen(ckpt, "r");
+	if (fp == NULL)
+		return -1;
+	int n = fscanf(fp, "vsha256sum checkpoint digest %64s offset %" SCNu64
+	               " bitlen %" SCNu64 " state %" SCNx32 " %" SCNx32 " %" SCNx32
+	               " %" SCNx32 " %" SCNx32 " %" SCNx32 " %" SCNx32 " %" SCNx32
+	               " data %128[0-9a-f]", hex, offset, &ctx->bitlen,
+	               &ctx->state[0], &ctx->state[1], &ctx->state[2], &ctx->state[3],
+	               &ctx->state[4], &ctx->state[5], &ctx->state[6], &ctx->state[7], data);
+	fclose(fp);
+	if (n < 11 || parse_digest(hex, strlen(hex), dgest) ||
+	    memcmp(dgest, rdgest, SHA256_BLOCK_SIZE))
+		return -1;
+
+	ctx->datalen = strlen(data) / 2;
+	for (uint32_t i = 0; i < ctx->datalen; i++)
+		ctx->data[i] = (a2b(data[i*2]) << 4) | a2b(data[(i*2) + 1]);
+	if (ctx->datalen >= 64 || ctx->bitlen != (*offset - ctx->datalen) * 8)
+		return -1;
+	return 0;
+}
+
+/* verifies the stream made of path's first offset bytes followed by
+ * stdin, appending stdin to path and forwarding the whole stream to
+ * stdout. offset < 0 means the current size of path. on a mismatch
+ * path is kept for the caller to resume or drop. a resume that gets
+ * nothing on stdin fails before writing anything
+ */
+static int verify_resumable(const char *path, long long offset, const char *hex)
+{
+	uint8_t rdgest[SHA256_BLOCK_SIZE], odgest[SHA256_BLOCK_SIZE];
+	static uint8_t buf[STREAM_BUFSIZE], in[STREAM_BUFSIZE];
+	SHA256_CTX ctx, fctx;
+	struct stat st;
+	uint64_t pos, hashed, last;
+	char ckpt[PATH_MAX];
+	ssize_t l, n;
+
+	if (parse_digest(hex, strlen(hex), rdgest)) {
+		fprintf(stderr, "invalid argument digest\n");
+		return 1;
+	}
+	ckpt_path(ckpt, sizeof(ckpt), path, ".ckpt");
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "vsha256sum: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (offset < 0)
+		offset = st.st_size;
+	if (offset > st.st_size) {
+		fprintf(stderr, "vsha256sum: %s: offset %lld is past its end\n", path, offset);
+		close(fd);
+		return 1;
+	}
+	if (offset < st.st_size && ftruncate(fd, offset)) {
+		fprintf(stderr, "vsha256sum: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	if (load_checkpoint(path, rdgest, &hashed, &ctx) || hashed > (uint64_t)offset) {
+		sha256_init(&ctx);
+		hashed = 0;
+	}
+
+	/* stdin is read before anything is replayed: a server refusing the
+	 * range sends nothing, and the caller can then start over from 0
+	 * with nothing of this attempt on its stdout (see retrieve.sh)
+	 */
+	while ((n = read(0, in, sizeof(in))) < 0 && errno == EINTR)
+		;
+	if (n == 0 && offset > 0) {
+		fprintf(stderr, "vsha256sum: %s: nothing to resume with\n", path);
+		close(fd);
+		return 1;
+	}
+
+	// replay what is already on disk, hashing only past the checkpoint
+	for (pos = 0; pos < (uint64_t)offset; pos += l) {
+		l = pread(fd, buf, sizeof(buf), pos);
+		if (l <= 0) {
+			fprintf(stderr, "vsha256sum: %s: %s\n", path, l ? strerror(errno) : "truncated");
+			close(fd);
+			return 1;
+		}
+		if (pos + l > hashed) {
+			size_t skip = hashed > pos ? hashed - pos : 0;
+			sha256_update(&ctx, buf + skip, l - skip);
+		}
+		if (write_all(1, buf, l)) {
+			perror("vsha256sum: write");
+			close(fd);
 			return 1;
 		}
-		// to lower
-		if (recvs[i] >= 'A' && recvs[i] <= 'F')
-			recvs[i] = 'a' + (recvs[i] - 'A'); 
 	}
 
-	for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
-		rdgest[i] = (a2b(recvs[i*2]) << 4) | a2b(recvs[(i*2) + 1]);
+	// continue with stdin, saving the midstate every CKPT_INTERVAL bytes
+	last = pos;
+	for (; n != 0; n = read(0, in, sizeof(in))) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("vsha256sum: read");
+			break;
+		}
+		stats_add(n);
+		if (pwrite(fd, in, n, pos) != n) {
+			fprintf(stderr, "vsha256sum: %s: %s\n", path, strerror(errno));
+			break;
+		}
+		sha256_update(&ctx, in, n);
+		pos += n;
+		if (write_all(1, in, n)) {
+			perror("vsha256sum: write");
+			break;
+		}
+		if (pos - last >= CKPT_INTERVAL) {
+			if (fdatasync(fd) == 0)
+				save_checkpoint(path, rdgest, pos, &ctx);
+			last = pos;
+		}
+	}
+	if (fdatasync(fd) == 0)
+		save_checkpoint(path, rdgest, pos, &ctx);
+	close(fd);
+
+	fctx = ctx;
+	sha256_final(&fctx, odgest);
+	if (memcmp(odgest, rdgest, SHA256_BLOCK_SIZE)) {
+		fprintf(stderr, "  expected ");
+		print_digest(stderr, rdgest);
+		fprintf(stderr, "\n  received ");
+		print_digest(stderr, odgest);
+		fputs("\n", stderr);
+		/* path and its checkpoint stay: the stream may just have been
+		 * cut short. only the caller knows whether it was complete and
+		 * the download has to start over, see retrieve.sh
+		 */
+		return 1;
+	}
+	unlink(ckpt);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-l label] <sha256>\n", argv0);
+	fprintf(stderr, "usage: %s [-j threads] -c <manifest>\n", argv0);
+	fprintf(stderr, "usage: %s [-l label] -m <chunk list> <root sha256>\n", argv0);
+	fprintf(stderr, "usage: %s -M <chunk size> <chunk list>\n", argv0);
+	fprintf(stderr, "usage: %s [-l label] -C <file> [-o offset] <sha256>\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	SHA256_CTX ctx;
+	uint8_t rdgest[SHA256_BLOCK_SIZE];
+	uint8_t odgest[SHA256_BLOCK_SIZE];
+	const char *manifest = NULL, *chunks = NULL, *chunk_size = NULL, *resume = NULL;
+	const char *label = NULL;
+	long long offset = -1;
+	long nthreads = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:j:m:M:C:o:l:")) != -1) {
+		switch (opt) {
+		case 'c':
+			manifest = optarg;
+			break;
+		case 'm':
+			chunks = optarg;
+			break;
+		case 'M':
+			chunk_size = optarg;
+			break;
+		case 'C':
+			resume = optarg;
+			break;
+		case 'o': {
+			char *end;
+			errno = 0;
+			offset = strtoll(optarg, &end, 10);
+			if (!isdigit((unsigned char)optarg[0]) || *end || errno) {
+				fprintf(stderr, "vsha256sum: -o %s: not an offset\n", optarg);
+				return 1;
+			}
+			break;
+		}
+		case 'j':
+			nthreads = atol(optarg);
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (manifest != NULL) {
+		if (optind != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return check_manifest(manifest, nthreads);
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (chunk_size != NULL)
+		return make_chunk_list(chunk_size, argv[optind]);
+
+	stats_start(label);
+	if (chunks != NULL)
+		return stats_done(verify_chunked(chunks, argv[optind]));
+	if (resume != NULL)
+		return stats_done(verify_resumable(resume, offset, argv[optind]));
+	argv += optind - 1;
+
+	if (strlen(argv[1]) != SHA256_BLOCK_SIZE*2) {
+		fprintf(stderr, "digest too short. expecting %d letters\n", SHA256_BLOCK_SIZE*2);
+		return 1;
+	}
+
+	if (parse_digest(argv[1], SHA256_BLOCK_SIZE*2, rdgest)) {
+		fprintf(stderr, "invalid argument digest\n");
+		return 1;
+	}
 
 
 
 	sha256_init(&ctx);
 	while (1) {
-		if (feof(stdin))
+		static uint8_t buf[STREAM_BUFSIZE];
+		ssize_t l = read(0, buf, sizeof(buf));
+		if (l < 0 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			break;
+		stats_add(l);
+		sha256_update(&ctx, buf, l);
+		if (write_all(1, buf, l))
 			break;
-		char buf[64];
-		size_t l = fread(buf, 1, 64, stdin);
-		sha256_update(&ctx, (void*)buf, l);
-		write(1, buf, l);
-		
 	}
 	sha256_final(&ctx, odgest);
 //	puts(argv[1]);
@@ -245,7 +1392,8 @@ int main(int argc, char **argv)
 		for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
 			fprintf(stderr, "%02x", odgest[i]);
 		fputs("\n", stderr);
+		stats_done(1);
 		abort();
         }
-	return 0;
+	return stats_done(0);
 }